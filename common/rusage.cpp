@@ -22,7 +22,12 @@
 // OS/X only makes ru.ru_maxrss available as an extension
 #define _DARWIN_C_SOURCE 1
 
+// wait4 is not in POSIX, but is defined in BSD
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+
 #include <sys/resource.h>
+#include <sys/wait.h>
 #include <assert.h>
 
 #include "rusage.h"
@@ -57,13 +62,8 @@ RUsage RUsage::operator - (const RUsage &other) const {
 #error Missing definition to access maxrss on this platform
 #endif
 
-RUsage getRUsageChildren() {
+RUsage convertRUsage(const struct rusage &usage) {
   RUsage out;
-  struct rusage usage;
-
-  // Can not fail (who and pointer are vaild)
-  int ret = getrusage(RUSAGE_CHILDREN, &usage);
-  assert (ret == 0);
 
   // These two are extremely portable:
   out.utime = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1000000.0;
@@ -76,3 +76,20 @@ RUsage getRUsageChildren() {
 
   return out;
 }
+
+RUsage getRUsageChildren() {
+  struct rusage usage;
+
+  // Can not fail (who and pointer are vaild)
+  int ret = getrusage(RUSAGE_CHILDREN, &usage);
+  assert (ret == 0);
+
+  return convertRUsage(usage);
+}
+
+pid_t reapChild(int *status, RUsage *usage) {
+  struct rusage ru;
+  pid_t pid = wait4(-1, status, WNOHANG, &ru);
+  if (pid > 0) *usage = convertRUsage(ru);
+  return pid;
+}
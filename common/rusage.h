@@ -19,6 +19,9 @@
 #define RUSAGE_H
 
 #include <cstdint>
+#include <sys/types.h>
+
+struct rusage;
 
 struct RUsage {
   double utime;    // Time spent running userspace in seconds
@@ -36,4 +39,11 @@ struct RUsage {
 // This values reported only change after a call wait*()
 RUsage getRUsageChildren();
 
+// Reap any one terminated child without blocking, like waitpid(-1, status, WNOHANG).
+// On success, usage holds the resources consumed by that child alone (and its waited-for descendants).
+pid_t reapChild(int *status, RUsage *usage);
+
+// Convert usage reported by some other process which reaped the child
+RUsage convertRUsage(const struct rusage &usage);
+
 #endif
@@ -23,9 +23,12 @@
 
 #include "spawn.h"
 
-pid_t wake_spawn(const char *cmd, char **cmdline, char **environ) {
+pid_t wake_spawn(const char *cmd, char **cmdline, char **environ, int cgroup_procs) {
   pid_t pid = vfork();
   if (pid == 0) {
+    // Joining before exec means nothing the job starts can escape the cgroup.
+    // On failure, the job still runs; its accounting falls back to rusage.
+    if (cgroup_procs != -1 && write(cgroup_procs, "0", 1) != 1) { }
     execve(cmdline[0], cmdline, environ);
     _exit(127);
   }
@@ -18,6 +18,7 @@
 #ifndef SPAWN_H
 #define SPAWN_H
 
-pid_t wake_spawn(const char *cmd, char **cmdline, char **environ);
+// If cgroup_procs is not -1, the child moves itself there (a cgroup.procs file) before exec
+pid_t wake_spawn(const char *cmd, char **cmdline, char **environ, int cgroup_procs = -1);
 
 #endif
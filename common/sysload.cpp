@@ -0,0 +1,191 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "sysload.h"
+
+// Read the 'some avg10=' field of a /proc/pressure file
+static double read_pressure(const char *file) {
+  std::ifstream f(file);
+  std::string kind, avg10;
+  while (f >> kind >> avg10) {
+    if (kind == "some" && avg10.compare(0, 6, "avg10=") == 0)
+      return strtod(avg10.c_str() + 6, 0);
+    f.ignore(1024, '\n');
+  }
+  return -1;
+}
+
+SystemLoad get_system_load() {
+  SystemLoad out;
+  out.loadavg = -1;
+
+  std::ifstream loadavg("/proc/loadavg");
+  if (!(loadavg >> out.loadavg)) out.loadavg = -1;
+
+  out.cpu_some = read_pressure("/proc/pressure/cpu");
+  out.mem_some = read_pressure("/proc/pressure/memory");
+  out.io_some  = read_pressure("/proc/pressure/io");
+  return out;
+}
+
+// Find the directory of our cgroup for 'controller' ("" = the v2 unified hierarchy)
+static std::string cgroup_dir(const char *controller) {
+  std::ifstream f("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(f, line)) {
+    // hierarchy-id:controller-list:path
+    size_t c1 = line.find(':');
+    size_t c2 = line.find(':', c1+1);
+    if (c1 == std::string::npos || c2 == std::string::npos) continue;
+    std::string list = "," + line.substr(c1+1, c2-c1-1) + ",";
+    std::string path = line.substr(c2+1);
+    if (*controller == 0) {
+      if (list != ",,") continue;
+      std::ifstream unified("/sys/fs/cgroup/unified/cgroup.controllers");
+      return (unified ? "/sys/fs/cgroup/unified" : "/sys/fs/cgroup") + path;
+    } else if (list.find("," + std::string(controller) + ",") != std::string::npos) {
+      return "/sys/fs/cgroup/" + line.substr(c1+1, c2-c1-1) + path;
+    }
+  }
+  return "";
+}
+
+double get_cgroup_cpus() {
+  std::string v2 = cgroup_dir("");
+  if (!v2.empty()) {
+    std::ifstream f(v2 + "/cpu.max");
+    std::string quota;
+    double period;
+    if (f >> quota >> period && quota != "max" && period > 0)
+      return strtod(quota.c_str(), 0) / period;
+  }
+
+  std::string v1 = cgroup_dir("cpu");
+  if (!v1.empty()) {
+    std::ifstream q(v1 + "/cpu.cfs_quota_us"), p(v1 + "/cpu.cfs_period_us");
+    double quota, period;
+    if (q >> quota && p >> period && quota > 0 && period > 0)
+      return quota / period;
+  }
+
+  return 0;
+}
+
+std::string get_cgroup_dir() {
+  return cgroup_dir("");
+}
+
+uint64_t get_cgroup_memory() {
+  std::string v2 = cgroup_dir("");
+  if (!v2.empty()) {
+    std::ifstream f(v2 + "/memory.max");
+    std::string max;
+    if (f >> max && max != "max")
+      return strtoull(max.c_str(), 0, 10);
+  }
+
+  std::string v1 = cgroup_dir("memory");
+  if (!v1.empty()) {
+    std::ifstream f(v1 + "/memory.limit_in_bytes");
+    uint64_t max;
+    // An unlimited v1 cgroup reports a huge page-aligned number
+    if (f >> max && max < (UINT64_C(1) << 62))
+      return max;
+  }
+
+  return 0;
+}
+
+uint64_t get_available_memory() {
+  std::ifstream f("/proc/meminfo");
+  std::string key;
+  uint64_t kb;
+  while (f >> key >> kb) {
+    if (key == "MemAvailable:") return kb * 1024;
+    f.ignore(1024, '\n');
+  }
+  return 0;
+}
+
+bool ProcessTable::scan() {
+  children.clear();
+  rss.clear();
+
+  DIR *proc = opendir("/proc");
+  if (!proc) return false;
+
+  long page = sysconf(_SC_PAGESIZE);
+  struct dirent *f;
+  while ((f = readdir(proc))) {
+    char *end;
+    pid_t pid = strtol(f->d_name, &end, 10);
+    if (*end || end == f->d_name) continue;
+
+    // pid (comm) state ppid ... with rss as the 24th field; comm may contain spaces
+    std::ifstream stat(std::string("/proc/") + f->d_name + "/stat");
+    std::string line;
+    if (!std::getline(stat, line)) continue; // exited
+    size_t paren = line.rfind(')');
+    if (paren == std::string::npos) continue;
+
+    std::stringstream fields(line.substr(paren+2));
+    std::string state;
+    long ppid, pages = 0;
+    unsigned long long skip;
+    fields >> state >> ppid;
+    for (int i = 5; i < 24; ++i) fields >> skip;
+    fields >> pages;
+
+    children.emplace(ppid, pid);
+    rss[pid] = pages * page;
+  }
+
+  closedir(proc);
+  return true;
+}
+
+std::vector<pid_t> ProcessTable::tree(pid_t root) const {
+  std::vector<pid_t> out;
+  out.push_back(root);
+  for (size_t i = 0; i < out.size(); ++i) {
+    auto range = children.equal_range(out[i]);
+    for (auto it = range.first; it != range.second; ++it)
+      out.push_back(it->second);
+  }
+  return out;
+}
+
+uint64_t ProcessTable::tree_rss(pid_t root) const {
+  uint64_t total = 0;
+  for (pid_t pid : tree(root)) {
+    auto it = rss.find(pid);
+    if (it != rss.end()) total += it->second;
+  }
+  return total;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYSLOAD_H
+#define SYSLOAD_H
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A snapshot of how busy the machine is; unavailable quantities are negative
+struct SystemLoad {
+  double loadavg;  // 1-minute load average
+  double cpu_some; // pressure stall information: % of the last 10s some task waited for CPU
+  double mem_some; // ... for memory
+  double io_some;  // ... for IO
+};
+
+SystemLoad get_system_load();
+
+// CPUs and memory granted to wake's cgroup (v1 or v2); 0 if unlimited or unknown
+double get_cgroup_cpus();
+uint64_t get_cgroup_memory();
+
+// The directory of wake's cgroup in the v2 hierarchy; "" if there is none
+std::string get_cgroup_dir();
+
+// Memory which can be allocated without swapping (MemAvailable); 0 if unknown
+uint64_t get_available_memory();
+
+// A snapshot of every process on the machine (from /proc)
+struct ProcessTable {
+  std::unordered_multimap<pid_t, pid_t> children;
+  std::unordered_map<pid_t, uint64_t> rss; // resident bytes
+
+  bool scan(); // false if /proc is unavailable
+  std::vector<pid_t> tree(pid_t root) const; // root and all its descendants
+  uint64_t tree_rss(pid_t root) const;
+};
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+/* Protocol between wake and its job launcher (shim-wake <zygote> FD).
+ * Both ends run on the same machine, so structures are sent as-is.
+ * This header is shared by C and C++ code. */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* stdout, stderr and (optionally) cgroup.procs */
+#define ZYGOTE_MAX_FDS 3
+
+/* Sent by wake, with its descriptors attached as SCM_RIGHTS.
+ * It is followed by 'bytes' of null-terminated strings:
+ *   directory, stdin file, then 'argc' arguments and 'envc' environment entries. */
+struct zygote_request {
+  uint32_t fds;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t bytes;
+};
+
+/* Sent by the launcher */
+#define ZYGOTE_READY   1 /* once, at startup */
+#define ZYGOTE_SPAWNED 2 /* once per request, in order; pid is -errno on failure */
+#define ZYGOTE_EXITED  3 /* whenever a job terminates; status as from waitpid */
+
+struct zygote_event {
+  int32_t kind;
+  int32_t pid;
+  int32_t status;
+  int32_t pad;
+  struct rusage usage;
+};
+
+#endif
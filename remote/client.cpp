@@ -0,0 +1,278 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "remote.h"
+#include "json5.h"
+#include "mkdir_parents.h"
+
+// Run the job described by <input-json> on one of the remote-waked workers at <address>...
+// Its output is reproduced locally, and <output-json> reports usage, inputs and outputs as for fuse-wake.
+
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t wrote = write(fd, data, len);
+    if (wrote == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += wrote;
+    len -= wrote;
+  }
+  return true;
+}
+
+static std::string parent(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+static bool is_relative(const std::string &path) {
+  if (path.empty() || path[0] == '/') return false;
+  if (path == ".." || path.compare(0, 3, "../") == 0) return false;
+  return path.find("/../") == std::string::npos;
+}
+
+// Describe a workspace file to the worker; hash may be "" if wake did not supply it
+static bool describe(const std::string &path, std::string hash, JAST &visible, std::map<std::string, std::string> &content) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    std::cerr << "remote-wake: stat " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  JAST &entry = visible.add(JSON_OBJECT);
+  entry.add("path", std::string(path));
+  if (S_ISDIR(st.st_mode)) {
+    entry.add("type", "dir");
+  } else if (S_ISLNK(st.st_mode)) {
+    std::vector<char> target(st.st_size + 1);
+    ssize_t len = readlink(path.c_str(), target.data(), target.size());
+    if (len < 0) {
+      std::cerr << "remote-wake: readlink " << path << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    entry.add("type", "link");
+    entry.add("target", std::string(target.data(), len));
+  } else {
+    if (hash.size() != REMOTE_HASH_DIGITS) hash = hash_path(path);
+    if (hash.empty()) {
+      std::cerr << "remote-wake: hash " << path << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    entry.add("type", (st.st_mode & 0111) ? "exec" : "file");
+    entry.add("hash", std::string(hash));
+    content.insert(std::make_pair(hash, path));
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 4) {
+    std::cerr << "Syntax: remote-wake <input-json> <output-json> <address>..." << std::endl;
+    return 1;
+  }
+
+  JAST input;
+  if (!JAST::parse(argv[1], std::cerr, input))
+    return 1;
+
+  int out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+  if (out_fd < 0) {
+    std::cerr << "remote-wake: open " << argv[2] << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  // The worker needs the same description as wake gave us, plus enough to recreate the visible files
+  JAST job(JSON_OBJECT);
+  job.children.emplace_back("command", std::move(input.get("command")));
+  job.children.emplace_back("environment", std::move(input.get("environment")));
+  job.add("directory", std::string(input.get("directory").value));
+  job.add("stdin", std::string(input.get("stdin").value));
+
+  JAST &visible = job.add("visible", JSON_ARRAY);
+  JAST inputs(JSON_ARRAY);
+  std::map<std::string, std::string> content; // hash -> a path with that content
+  const JChildren &hashes = input.get("hashes").children;
+  const JChildren &names = input.get("visible").children;
+  bool has_stdin = input.get("stdin").value.empty();
+  for (size_t i = 0; i < names.size(); ++i) {
+    const std::string &name = names[i].second.value;
+    if (!is_relative(name)) continue; // the worker provides files outside the workspace
+    if (!describe(name, i < hashes.size() ? hashes[i].second.value : "", visible, content))
+      return 1;
+    // The worker does not trace file access, so every visible file is reported as an input
+    inputs.add(std::string(name));
+    if (name == input.get("stdin").value) has_stdin = true;
+  }
+  if (!has_stdin && !describe(input.get("stdin").value, "", visible, content))
+    return 1;
+
+  // Spread jobs over the workers, passing over any which cannot be reached
+  int naddr = argc - 3;
+  int sock = -1;
+  std::string why;
+  for (int i = 0; sock == -1 && i < naddr; ++i)
+    sock = remote_connect(argv[3 + (getpid() + i) % naddr], why);
+  if (sock == -1) {
+    std::cerr << "remote-wake: " << why << std::endl;
+    return 1;
+  }
+
+  std::stringstream js;
+  js << job;
+  if (!send_frame(sock, REMOTE_JOB, js.str())) {
+    std::cerr << "remote-wake: send: " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  char kind;
+  std::string payload;
+  JAST need;
+  if (!recv_frame(sock, kind, payload) || kind != REMOTE_NEED || !JAST::parse(payload, std::cerr, need)) {
+    std::cerr << "remote-wake: worker hung up before accepting the job" << std::endl;
+    return 1;
+  }
+
+  for (auto &x : need.children) {
+    auto it = content.find(x.second.value);
+    if (it == content.end()) {
+      std::cerr << "remote-wake: worker asked for unknown content " << x.second.value << std::endl;
+      return 1;
+    }
+    JAST header(JSON_OBJECT);
+    header.add("hash", std::string(it->first));
+    std::stringstream hs;
+    hs << header;
+    int fd = open(it->second.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      std::cerr << "remote-wake: open " << it->second << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+    bool ok = send_frame(sock, REMOTE_FILE, hs.str()) && send_file(sock, fd);
+    close(fd);
+    if (!ok) {
+      std::cerr << "remote-wake: send " << it->second << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+
+  // Reproduce the job's output streams and files as they arrive
+  JAST outputs(JSON_ARRAY);
+  JAST file;
+  std::string tmp;
+  int file_fd = -1;
+  while (true) {
+    if (!recv_frame(sock, kind, payload)) {
+      std::cerr << "remote-wake: worker hung up before the job finished" << std::endl;
+      return 1;
+    }
+
+    if (kind == REMOTE_STDOUT) {
+      write_all(STDOUT_FILENO, payload.data(), payload.size());
+    } else if (kind == REMOTE_STDERR) {
+      write_all(STDERR_FILENO, payload.data(), payload.size());
+    } else if (kind == REMOTE_FILE) {
+      if (!JAST::parse(payload, std::cerr, file)) return 1;
+      const std::string &path = file.get("path").value;
+      const std::string &type = file.get("type").value;
+      if (!is_relative(path)) {
+        std::cerr << "remote-wake: worker produced a file outside the workspace: " << path << std::endl;
+        return 1;
+      }
+      int err = mkdir_with_parents(type == "dir" ? path : parent(path), 0775);
+      if (err != 0) {
+        std::cerr << "remote-wake: mkdir " << path << ": " << strerror(err) << std::endl;
+        return 1;
+      }
+      if (type == "file") {
+        tmp = path + ".remote-wake." + std::to_string(getpid());
+        file_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (file_fd == -1) {
+          std::cerr << "remote-wake: open " << tmp << ": " << strerror(errno) << std::endl;
+          return 1;
+        }
+      }
+    } else if (kind == REMOTE_DATA && !payload.empty()) {
+      if (file_fd == -1 || !write_all(file_fd, payload.data(), payload.size())) {
+        std::cerr << "remote-wake: write " << tmp << ": " << strerror(errno) << std::endl;
+        return 1;
+      }
+    } else if (kind == REMOTE_DATA) {
+      // The file is complete; replace whatever was in the workspace
+      const std::string &path = file.get("path").value;
+      const std::string &type = file.get("type").value;
+      mode_t mode = std::stoi(file.get("mode").value) & 07777;
+      bool ok = true;
+      if (type == "file") {
+        ok = fchmod(file_fd, mode) == 0 && close(file_fd) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+        file_fd = -1;
+      } else if (type == "link") {
+        unlink(path.c_str());
+        ok = symlink(file.get("target").value.c_str(), path.c_str()) == 0;
+      } else {
+        ok = chmod(path.c_str(), mode) == 0;
+      }
+      if (!ok) {
+        std::cerr << "remote-wake: create " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+      }
+      outputs.add(std::string(path));
+    } else if (kind == REMOTE_DONE) {
+      break;
+    } else if (kind == REMOTE_ERROR) {
+      std::cerr << "remote-wake: " << payload << std::endl;
+      return 1;
+    }
+  }
+  close(sock);
+
+  JAST result(JSON_OBJECT);
+  JAST &usage = result.add("usage", JSON_OBJECT);
+  if (!JAST::parse(payload, std::cerr, usage)) return 1;
+  result.children.emplace_back("inputs", std::move(inputs));
+  result.children.emplace_back("outputs", std::move(outputs));
+
+  std::stringstream rs;
+  rs << result;
+  std::string json = rs.str();
+  if (!write_all(out_fd, json.data(), json.size()) || close(out_fd) != 0) {
+    std::cerr << "remote-wake: write " << argv[2] << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,455 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "remote.h"
+#include "execpath.h"
+#include "json5.h"
+#include "mkdir_parents.h"
+#include "rusage.h"
+#include "unlink.h"
+
+// A worker which runs jobs for remote-wake:
+//   remote-waked [-j jobs] <address> <directory>
+// Content received from clients is kept in <directory>/store, named by its hash.
+// Each job runs in its own <directory>/jobs/<pid>, populated with only its visible files.
+// There is no authentication: anyone who can connect to <address> can run commands as this user.
+// A TCP <address> with no host listens only on loopback for that reason.
+
+struct Entry {
+  std::string type; // file, exec, link, or dir
+  std::string hash;
+  std::string target;
+};
+
+static void fail(int sock, const std::string &why) {
+  send_frame(sock, REMOTE_ERROR, why);
+  exit(1);
+}
+
+static bool is_hash(const std::string &hash) {
+  if (hash.size() != REMOTE_HASH_DIGITS) return false;
+  for (char c : hash)
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+  return true;
+}
+
+// Only paths within the workspace can be placed in the sandbox
+static bool is_relative(const std::string &path) {
+  if (path.empty() || path[0] == '/') return false;
+  if (path == ".." || path.compare(0, 3, "../") == 0) return false;
+  if (path.find("/../") != std::string::npos) return false;
+  return path.size() < 3 || path.compare(path.size()-3, 3, "/..") != 0;
+}
+
+static std::string parent(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+static bool copy_file(const std::string &from, const std::string &to, mode_t mode) {
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) return false;
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (out == -1) {
+    close(in);
+    return false;
+  }
+
+  char buffer[REMOTE_CHUNK];
+  ssize_t got;
+  bool ok = true;
+  while (ok && (got = read(in, buffer, sizeof(buffer))) != 0) {
+    if (got == -1) {
+      if (errno != EINTR) ok = false;
+      continue;
+    }
+    for (ssize_t done = 0, wrote; ok && done < got; done += wrote)
+      if ((wrote = write(out, buffer + done, got - done)) == -1) ok = false;
+  }
+
+  ok = fchmod(out, mode) == 0 && ok;
+  close(in);
+  return close(out) == 0 && ok;
+}
+
+// Receive one file announced by FILE {hash} into the store
+static void receive_blob(int sock, const std::string &store, std::set<std::string> &need) {
+  char kind;
+  std::string payload;
+  if (!recv_frame(sock, kind, payload) || kind != REMOTE_FILE) exit(1);
+
+  JAST header;
+  std::stringstream errs;
+  if (!JAST::parse(payload, errs, header)) fail(sock, errs.str());
+  std::string hash = header.get("hash").value;
+  if (need.erase(hash) == 0) fail(sock, "unexpected content for " + hash);
+
+  std::string tmp = store + "/.tmp." + std::to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) fail(sock, "open " + tmp + ": " + strerror(errno));
+
+  remote_hasher hasher;
+  while (true) {
+    if (!recv_frame(sock, kind, payload) || kind != REMOTE_DATA) exit(1);
+    if (payload.empty()) break;
+    hasher.update(payload.data(), payload.size());
+    for (size_t done = 0; done < payload.size(); ) {
+      ssize_t wrote = write(fd, payload.data() + done, payload.size() - done);
+      if (wrote == -1) fail(sock, "write " + tmp + ": " + strerror(errno));
+      done += wrote;
+    }
+  }
+
+  // Content is only ever copied out of the store, so nothing should modify it
+  if (fchmod(fd, 0444) != 0 || close(fd) != 0)
+    fail(sock, "close " + tmp + ": " + strerror(errno));
+  if (hasher.hex() != hash) {
+    unlink(tmp.c_str());
+    fail(sock, "content sent for " + hash + " has a different hash");
+  }
+  if (rename(tmp.c_str(), (store + "/" + hash).c_str()) != 0)
+    fail(sock, "rename " + tmp + ": " + strerror(errno));
+}
+
+// A placed file which the job replaced, or rewrote in place, is part of its output
+static bool unchanged(const struct stat &was, const struct stat &is) {
+  return was.st_ino == is.st_ino && was.st_size == is.st_size
+    && was.st_mtim.tv_sec == is.st_mtim.tv_sec && was.st_mtim.tv_nsec == is.st_mtim.tv_nsec;
+}
+
+static void scan(const std::string &root, const std::string &prefix, std::vector<std::string> &out) {
+  std::string dir = prefix.empty() ? root : root + "/" + prefix;
+  DIR *d = opendir(dir.c_str());
+  if (!d) return;
+
+  struct dirent *f;
+  while ((f = readdir(d))) {
+    if (!strcmp(f->d_name, ".") || !strcmp(f->d_name, "..")) continue;
+    std::string path = prefix.empty() ? f->d_name : prefix + "/" + f->d_name;
+    out.push_back(path);
+    struct stat st;
+    if (lstat((root + "/" + path).c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+      scan(root, path, out);
+  }
+
+  closedir(d);
+}
+
+static void forward(int sock, int fd, char kind, bool &open) {
+  char buffer[REMOTE_CHUNK];
+  ssize_t got = read(fd, buffer, sizeof(buffer));
+  if (got == -1 && errno == EINTR) return;
+  if (got <= 0) {
+    open = false;
+    return;
+  }
+  if (!send_frame(sock, kind, buffer, got)) {
+    // The client is gone; so is any reason to continue
+    kill(0, SIGKILL);
+  }
+}
+
+static void serve(int sock, const std::string &root) {
+  char kind;
+  std::string payload;
+  if (!recv_frame(sock, kind, payload) || kind != REMOTE_JOB) exit(1);
+
+  JAST job;
+  std::stringstream errs;
+  if (!JAST::parse(payload, errs, job)) fail(sock, errs.str());
+
+  std::string store = root + "/store";
+  std::map<std::string, Entry> visible;
+  std::set<std::string> need;
+  for (auto &x : job.get("visible").children) {
+    std::string path = x.second.get("path").value;
+    if (!is_relative(path)) continue;
+    Entry &entry = visible[path];
+    entry.type = x.second.get("type").value;
+    entry.hash = x.second.get("hash").value;
+    entry.target = x.second.get("target").value;
+    if (entry.type == "file" || entry.type == "exec") {
+      if (!is_hash(entry.hash)) fail(sock, "bad hash for " + path);
+      if (access((store + "/" + entry.hash).c_str(), F_OK) != 0) need.insert(entry.hash);
+    }
+  }
+
+  // Ask for the content this worker has not seen before
+  JAST want(JSON_ARRAY);
+  for (auto &hash : need) want.add(std::string(hash));
+  std::stringstream ss;
+  ss << want;
+  if (!send_frame(sock, REMOTE_NEED, ss.str())) exit(1);
+  while (!need.empty()) receive_blob(sock, store, need);
+
+  // Populate the sandbox with exactly the visible files
+  std::string sandbox = root + "/jobs/" + std::to_string(getpid());
+  deep_unlink(AT_FDCWD, sandbox.c_str());
+  int err = mkdir_with_parents(sandbox, 0775);
+  if (err != 0) fail(sock, "mkdir " + sandbox + ": " + strerror(err));
+
+  for (auto &x : visible) {
+    std::string path = sandbox + "/" + x.first;
+    const Entry &entry = x.second;
+    if (entry.type == "dir") {
+      if ((err = mkdir_with_parents(path, 0775)) != 0)
+        fail(sock, "mkdir " + path + ": " + strerror(err));
+      continue;
+    }
+    if ((err = mkdir_with_parents(parent(path), 0775)) != 0)
+      fail(sock, "mkdir " + parent(path) + ": " + strerror(err));
+    if (entry.type == "link") {
+      if (symlink(entry.target.c_str(), path.c_str()) != 0)
+        fail(sock, "symlink " + path + ": " + strerror(errno));
+    } else {
+      // A copy, so that a job which writes to its inputs cannot corrupt the store
+      std::string from = store + "/" + entry.hash;
+      if (!copy_file(from, path, entry.type == "exec" ? 0555 : 0444))
+        fail(sock, "copy " + path + ": " + strerror(errno));
+    }
+  }
+
+  std::string directory = job.get("directory").value;
+  if (directory.empty()) directory = ".";
+  if (!is_relative(directory) && directory != ".") fail(sock, "job directory is outside the workspace: " + directory);
+  std::string cwd = sandbox + "/" + directory;
+  if ((err = mkdir_with_parents(cwd, 0775)) != 0)
+    fail(sock, "mkdir " + cwd + ": " + strerror(err));
+
+  // Remember what was placed, so that anything else can be recognized as the job's output
+  std::map<std::string, struct stat> placed;
+  std::vector<std::string> paths;
+  scan(sandbox, "", paths);
+  for (auto &rel : paths) {
+    struct stat st;
+    if (lstat((sandbox + "/" + rel).c_str(), &st) == 0) placed[rel] = st;
+  }
+
+  std::string stdin_file = job.get("stdin").value;
+  if (stdin_file.empty()) {
+    stdin_file = "/dev/null";
+  } else if (is_relative(stdin_file)) {
+    stdin_file = sandbox + "/" + stdin_file;
+  }
+
+  std::vector<std::string> command, environment;
+  for (auto &x : job.get("command").children) command.push_back(x.second.value);
+  for (auto &x : job.get("environment").children) environment.push_back(x.second.value);
+  if (command.empty()) fail(sock, "no command to run");
+
+  int out[2], errp[2];
+  if (pipe(out) != 0 || pipe(errp) != 0) fail(sock, std::string("pipe: ") + strerror(errno));
+
+  struct timeval start;
+  gettimeofday(&start, 0);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    int fd = open(stdin_file.c_str(), O_RDONLY);
+    if (fd == -1 || chdir(cwd.c_str()) != 0) {
+      std::string why = (fd == -1 ? "open " + stdin_file : "chdir " + cwd) + ": " + strerror(errno) + "\n";
+      (void)!write(errp[1], why.data(), why.size());
+      _exit(1);
+    }
+    dup2(fd, STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(errp[1], STDERR_FILENO);
+    if (fd > STDERR_FILENO) close(fd);
+    close(out[0]);
+    close(out[1]);
+    close(errp[0]);
+    close(errp[1]);
+    close(sock);
+
+    std::vector<const char *> argv, envp;
+    command[0] = find_in_path(command[0], find_path(environment));
+    for (auto &s : command) argv.push_back(s.c_str());
+    for (auto &s : environment) envp.push_back(s.c_str());
+    argv.push_back(nullptr);
+    envp.push_back(nullptr);
+
+    execve(argv[0], const_cast<char * const *>(argv.data()), const_cast<char * const *>(envp.data()));
+    std::cerr << "execve " << argv[0] << ": " << strerror(errno) << std::endl;
+    _exit(127);
+  }
+  close(out[1]);
+  close(errp[1]);
+  if (pid == -1) fail(sock, std::string("fork: ") + strerror(errno));
+
+  // Stream output back as the job produces it
+  bool out_open = true, err_open = true;
+  while (out_open || err_open) {
+    struct pollfd fds[2];
+    fds[0].fd = out_open ? out[0] : -1;
+    fds[0].events = POLLIN;
+    fds[1].fd = err_open ? errp[0] : -1;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      fail(sock, std::string("poll: ") + strerror(errno));
+    }
+    if (fds[0].revents) forward(sock, out[0], REMOTE_STDOUT, out_open);
+    if (fds[1].revents) forward(sock, errp[0], REMOTE_STDERR, err_open);
+  }
+  close(out[0]);
+  close(errp[0]);
+
+  int status;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR) { }
+  status = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+
+  // This process only ever has the one child
+  RUsage usage = getRUsageChildren();
+  struct timeval stop;
+  gettimeofday(&stop, 0);
+
+  // Anything which was not placed in the sandbox, or has changed since, was written by the job
+  paths.clear();
+  scan(sandbox, "", paths);
+  for (auto &rel : paths) {
+    std::string path = sandbox + "/" + rel;
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) continue;
+
+    auto it = placed.find(rel);
+    if (it != placed.end() && (S_ISDIR(st.st_mode) || unchanged(it->second, st))) continue;
+
+    JAST header(JSON_OBJECT);
+    header.add("path", std::string(rel));
+    header.add("mode", (int)(st.st_mode & 07777));
+    int fd = -1;
+    if (S_ISDIR(st.st_mode)) {
+      header.add("type", "dir");
+    } else if (S_ISLNK(st.st_mode)) {
+      std::vector<char> target(st.st_size + 1);
+      ssize_t len = readlink(path.c_str(), target.data(), target.size());
+      if (len < 0) continue;
+      header.add("type", "link");
+      header.add("target", std::string(target.data(), len));
+    } else if (S_ISREG(st.st_mode)) {
+      if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) == -1) continue;
+      header.add("type", "file");
+    } else {
+      continue;
+    }
+
+    std::stringstream hs;
+    hs << header;
+    bool ok = send_frame(sock, REMOTE_FILE, hs.str());
+    if (fd != -1) {
+      ok = ok && send_file(sock, fd);
+      close(fd);
+    } else {
+      ok = ok && send_frame(sock, REMOTE_DATA, "", 0);
+    }
+    if (!ok) exit(1);
+  }
+
+  JAST done(JSON_OBJECT);
+  done.add("status", status);
+  done.add("runtime", stop.tv_sec - start.tv_sec + (stop.tv_usec - start.tv_usec)/1000000.0);
+  done.add("cputime", usage.utime + usage.stime);
+  done.add("membytes", static_cast<long long>(usage.membytes));
+  done.add("inbytes", static_cast<long long>(usage.ibytes));
+  done.add("outbytes", static_cast<long long>(usage.obytes));
+  std::stringstream ds;
+  ds << done;
+  send_frame(sock, REMOTE_DONE, ds.str());
+
+  deep_unlink(AT_FDCWD, sandbox.c_str());
+}
+
+int main(int argc, char *argv[]) {
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int arg = 1;
+  if (argc > 2 && !strcmp(argv[1], "-j")) {
+    jobs = strtol(argv[2], nullptr, 10);
+    arg = 3;
+  }
+  if (argc - arg != 2 || jobs < 1) {
+    std::cerr << "Syntax: remote-waked [-j jobs] <address> <directory>" << std::endl;
+    return 1;
+  }
+
+  std::string address = argv[arg];
+  std::string root = argv[arg+1];
+
+  // Sandboxes left behind by an earlier worker are of no further use
+  deep_unlink(AT_FDCWD, (root + "/jobs").c_str());
+  int err;
+  if ((err = mkdir_with_parents(root + "/store", 0775)) != 0 || (err = mkdir_with_parents(root + "/jobs", 0775)) != 0) {
+    std::cerr << "mkdir " << root << ": " << strerror(err) << std::endl;
+    return 1;
+  }
+
+  std::string why;
+  int listenfd = remote_listen(address, why);
+  if (listenfd == -1) {
+    std::cerr << why << std::endl;
+    return 1;
+  }
+
+  long running = 0;
+  while (true) {
+    int status;
+    while (running > 0 && waitpid(-1, &status, running >= jobs ? 0 : WNOHANG) > 0) --running;
+
+    int sock = accept(listenfd, nullptr, nullptr);
+    if (sock == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(listenfd);
+      // A process group per connection, so a lost client can take its job down with it
+      setpgid(0, 0);
+      serve(sock, root);
+      exit(0);
+    }
+    if (pid == -1) perror("fork");
+    else ++running;
+    close(sock);
+  }
+}
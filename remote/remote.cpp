@@ -0,0 +1,294 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "remote.h"
+
+// Matches shim-wake's choice of digest length
+#define HASH_BYTES (REMOTE_HASH_DIGITS/2)
+
+// A peer which hung up should be an error, not a fatal signal
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static bool is_unix(const std::string &address, std::string &path) {
+  if (address.compare(0, 5, "unix:") == 0) {
+    path = address.substr(5);
+    return true;
+  }
+  if (address.find('/') != std::string::npos) {
+    path = address;
+    return true;
+  }
+  return false;
+}
+
+static int unix_socket(const std::string &path, struct sockaddr_un &addr, std::string &why) {
+  if (path.size() >= sizeof(addr.sun_path)) {
+    why = "socket path too long: " + path;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size()+1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) why = std::string("socket: ") + strerror(errno);
+  return fd;
+}
+
+static struct addrinfo *tcp_lookup(const std::string &address, std::string &why) {
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    why = "address is neither unix:PATH nor HOST:PORT: " + address;
+    return nullptr;
+  }
+
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon+1);
+  if (host.size() >= 2 && host[0] == '[') host = host.substr(1, host.size()-2);
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  // Without AI_PASSIVE, an empty host is loopback; workers listen on all interfaces only when asked
+  int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+  if (err != 0) {
+    why = "getaddrinfo " + address + ": " + gai_strerror(err);
+    return nullptr;
+  }
+  return res;
+}
+
+static void cloexec(int fd) {
+  int flags;
+  if ((flags = fcntl(fd, F_GETFD, 0)) != -1) fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+int remote_listen(const std::string &address, std::string &why) {
+  std::string path;
+  if (is_unix(address, path)) {
+    struct sockaddr_un addr;
+    int fd = unix_socket(path, addr, why);
+    if (fd == -1) return -1;
+    unlink(path.c_str()); // a stale socket from an earlier worker
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+      why = "bind " + path + ": " + strerror(errno);
+      close(fd);
+      return -1;
+    }
+    cloexec(fd);
+    return fd;
+  }
+
+  struct addrinfo *res = tcp_lookup(address, why);
+  if (!res) return -1;
+
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) break;
+    why = "bind " + address + ": " + strerror(errno);
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd != -1) cloexec(fd);
+  return fd;
+}
+
+int remote_connect(const std::string &address, std::string &why) {
+  std::string path;
+  if (is_unix(address, path)) {
+    struct sockaddr_un addr;
+    int fd = unix_socket(path, addr, why);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+      why = "connect " + path + ": " + strerror(errno);
+      close(fd);
+      return -1;
+    }
+    cloexec(fd);
+    return fd;
+  }
+
+  struct addrinfo *res = tcp_lookup(address, why);
+  if (!res) return -1;
+
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1) continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    why = "connect " + address + ": " + strerror(errno);
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd != -1) {
+    // Frames are written whole; there is nothing to gain by delaying them
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    cloexec(fd);
+  }
+  return fd;
+}
+
+bool send_frame(int fd, char kind, const char *data, size_t len) {
+  unsigned char header[5];
+  uint32_t size = htonl(len);
+  memcpy(header, &size, 4);
+  header[4] = kind;
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = const_cast<char*>(data);
+  iov[1].iov_len = len;
+
+  struct iovec *next = iov;
+  int count = len ? 2 : 1;
+  while (count > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = next;
+    msg.msg_iovlen = count;
+    ssize_t wrote = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (wrote == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    while (count > 0 && (size_t)wrote >= next->iov_len) {
+      wrote -= next->iov_len;
+      ++next;
+      --count;
+    }
+    if (count > 0) {
+      next->iov_base = static_cast<char*>(next->iov_base) + wrote;
+      next->iov_len -= wrote;
+    }
+  }
+
+  return true;
+}
+
+static bool read_all(int fd, char *data, size_t len) {
+  while (len > 0) {
+    ssize_t got = read(fd, data, len);
+    if (got == 0) return false;
+    if (got == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += got;
+    len -= got;
+  }
+  return true;
+}
+
+bool recv_frame(int fd, char &kind, std::string &payload) {
+  char header[5];
+  if (!read_all(fd, header, sizeof(header))) return false;
+
+  uint32_t size;
+  memcpy(&size, header, 4);
+  size = ntohl(size);
+  if (size > REMOTE_MAX_FRAME) return false;
+
+  kind = header[4];
+  payload.resize(size);
+  return read_all(fd, &payload[0], size);
+}
+
+bool send_file(int sock, int fd) {
+  char buffer[REMOTE_CHUNK];
+  ssize_t got;
+  while ((got = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (got == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (!send_frame(sock, REMOTE_DATA, buffer, got)) return false;
+  }
+  return send_frame(sock, REMOTE_DATA, buffer, 0);
+}
+
+remote_hasher::remote_hasher() {
+  blake2b_init(&state, HASH_BYTES);
+}
+
+void remote_hasher::update(const char *data, size_t len) {
+  blake2b_update(&state, reinterpret_cast<const uint8_t*>(data), len);
+}
+
+std::string remote_hasher::hex() {
+  static const char digits[] = "0123456789abcdef";
+  uint8_t hash[HASH_BYTES];
+  blake2b_final(&state, &hash[0], sizeof(hash));
+
+  std::string out;
+  for (int i = 0; i < HASH_BYTES; ++i) {
+    out.push_back(digits[hash[i] >> 4]);
+    out.push_back(digits[hash[i] & 15]);
+  }
+  return out;
+}
+
+std::string hash_path(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return "";
+
+  remote_hasher hasher;
+  char buffer[8192];
+  ssize_t got;
+  while ((got = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (got == -1) {
+      if (errno == EINTR) continue;
+      close(fd);
+      return "";
+    }
+    hasher.update(buffer, got);
+  }
+
+  close(fd);
+  return hasher.hex();
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REMOTE_H
+#define REMOTE_H
+
+/* Protocol between remote-wake (which runs a job for wake) and remote-waked (which executes it).
+ * Every message is a frame: a 4-byte big-endian payload length, a 1-byte kind, then the payload.
+ *
+ *   remote-wake                          remote-waked
+ *   JOB   {command, environment, ...} ->
+ *                                     <- NEED  [hashes missing from the worker's store]
+ *   FILE  {hash} + DATA... + DATA ""  ->   (once per needed hash)
+ *                                     <- STDOUT / STDERR as the job writes them
+ *                                     <- FILE  {path, type, mode, target} + DATA... + DATA ""
+ *                                     <- DONE  {status, runtime, cputime, membytes, inbytes, outbytes}
+ *
+ * Instead of DONE, the worker may send ERROR with an explanation at any time.
+ * Visible files are named by the hash wake already has for them (blake2b, as from shim-wake),
+ * so a worker which has seen the content before needs nothing but the job's description. */
+
+#include <string>
+
+#include "blake2.h"
+
+#define REMOTE_JOB    'J'
+#define REMOTE_NEED   'N'
+#define REMOTE_FILE   'F'
+#define REMOTE_DATA   'D'
+#define REMOTE_STDOUT 'O'
+#define REMOTE_STDERR 'E'
+#define REMOTE_DONE   'U'
+#define REMOTE_ERROR  'X'
+
+// Files are streamed in DATA frames of at most this many bytes
+#define REMOTE_CHUNK (64*1024)
+// Refuse frames larger than this (a JOB with very many visible files is the largest)
+#define REMOTE_MAX_FRAME (256*1024*1024)
+
+// Hashes are this many hex digits
+#define REMOTE_HASH_DIGITS 64
+
+// Addresses are "unix:/path/to/socket", a path containing a '/', or "host:port"
+// An empty host (":port") is loopback; listen on "0.0.0.0:port" or "[::]:port" for other machines
+int remote_listen(const std::string &address, std::string &why);
+int remote_connect(const std::string &address, std::string &why);
+
+bool send_frame(int fd, char kind, const char *data, size_t len);
+inline bool send_frame(int fd, char kind, const std::string &data) { return send_frame(fd, kind, data.data(), data.size()); }
+// False on EOF or error; the connection is then unusable
+bool recv_frame(int fd, char &kind, std::string &payload);
+
+// Send the content of an open file as DATA frames, ending with an empty one
+bool send_file(int sock, int fd);
+
+// Computes the hash wake records for a file's content
+struct remote_hasher {
+  blake2b_state state;
+  remote_hasher();
+  void update(const char *data, size_t len);
+  std::string hex();
+};
+
+// The hash of a regular file, or "" on failure
+std::string hash_path(const std::string &path);
+
+#endif
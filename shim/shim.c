@@ -30,6 +30,7 @@
 
 #include "blake2.h"
 #include "nofollow.h"
+#include "shim.h"
 
 // Can increase to 64 if needed
 #define HASH_BYTES 32
@@ -117,27 +118,20 @@ static int do_hash(const char *file) {
   return do_hash_file(file, fd);
 }
 
-int main(int argc, char **argv) {
-  int stdin_fd, stdout_fd, stderr_fd;
-  const char *dir;
-
-  if (argc < 6) return 1;
+int run_job(const char *dir, const char *stdin_file, int stdout_fd, int stderr_fd, char **cmd) {
+  int stdin_fd;
 
-  dir = argv[4];
   if ((dir[0] != '.' || dir[1] != 0) && chdir(dir)) {
     fprintf(stderr, "chdir: %s: %s\n", dir, strerror(errno));
     return 127;
   }
 
-  stdin_fd = open(argv[1], O_RDONLY);
+  stdin_fd = open(stdin_file, O_RDONLY);
   if (stdin_fd == -1) {
-    fprintf(stderr, "open: %s: %s\n", argv[1], strerror(errno));
+    fprintf(stderr, "open: %s: %s\n", stdin_file, strerror(errno));
     return 127;
   }
 
-  stdout_fd = atoi(argv[2]);
-  stderr_fd = atoi(argv[3]);
-
   while (stdin_fd  <= 2 && stdin_fd  != 0) stdin_fd  = dup(stdin_fd);
   while (stdout_fd <= 2 && stderr_fd != 1) stdout_fd = dup(stdout_fd);
   while (stderr_fd <= 2 && stdout_fd != 2) stderr_fd = dup(stderr_fd);
@@ -157,11 +151,20 @@ int main(int argc, char **argv) {
     close(stderr_fd);
   }
 
-  if (strcmp(argv[5], "<hash>")) {
-    execvp(argv[5], argv+5);
-    fprintf(stderr, "execvp: %s: %s\n", argv[5], strerror(errno));
+  if (strcmp(cmd[0], "<hash>")) {
+    execvp(cmd[0], cmd);
+    fprintf(stderr, "execvp: %s: %s\n", cmd[0], strerror(errno));
     return 127;
   } else {
-    return do_hash(argv[6]);
+    return do_hash(cmd[1]);
   }
 }
+
+int main(int argc, char **argv) {
+  if (argc == 3 && !strcmp(argv[1], "<zygote>"))
+    return do_zygote(atoi(argv[2]));
+
+  if (argc < 6) return 1;
+
+  return run_job(argv[4], argv[1], atoi(argv[2]), atoi(argv[3]), argv+5);
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHIM_H
+#define SHIM_H
+
+/* chdir, redirect stdio, and exec cmd (or hash cmd[1] if cmd[0] is "<hash>").
+ * Returns only on failure, or with the result of hashing. */
+int run_job(const char *dir, const char *stdin_file, int stdout_fd, int stderr_fd, char **cmd);
+
+/* Serve launch requests from wake on socket 'sock' until it is closed */
+int do_zygote(int sock);
+
+#endif
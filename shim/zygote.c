@@ -0,0 +1,281 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+// wait4 is not in POSIX, but is defined in BSD
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE 1
+
+/* Wake job launcher: a small long-lived process which forks jobs for wake.
+ * Forking this process is much cheaper than forking wake and its heap,
+ * and it execs the job directly (no second exec of the shim). */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "zygote.h"
+#include "shim.h"
+
+extern char **environ;
+
+// Events which the socket has not yet accepted
+static char *outbox;
+static size_t outbox_size, outbox_cap;
+
+static volatile sig_atomic_t child_ready = 0;
+
+static void handle_SIGCHLD(int sig) {
+  (void)sig;
+  child_ready = 1;
+}
+
+// wake decides when jobs should stop; the launcher lives until wake closes the socket
+static const int ignored[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM };
+
+static void post(int kind, pid_t pid, int status, const struct rusage *usage) {
+  struct zygote_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.kind = kind;
+  ev.pid = pid;
+  ev.status = status;
+  if (usage) ev.usage = *usage;
+
+  if (outbox_size + sizeof(ev) > outbox_cap) {
+    outbox_cap = outbox_cap ? 2*outbox_cap : 64*sizeof(ev);
+    outbox = realloc(outbox, outbox_cap);
+    if (!outbox) {
+      perror("shim zygote realloc");
+      exit(1);
+    }
+  }
+
+  memcpy(outbox + outbox_size, &ev, sizeof(ev));
+  outbox_size += sizeof(ev);
+}
+
+// Never blocks; returns 0 if wake has gone away
+static int flush(int sock) {
+  size_t done = 0;
+  ssize_t got;
+
+  while (done < outbox_size) {
+    got = send(sock, outbox + done, outbox_size - done, MSG_DONTWAIT);
+    if (got > 0) {
+      done += got;
+    } else if (got == -1 && errno == EINTR) {
+      continue;
+    } else if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      return 0;
+    }
+  }
+
+  memmove(outbox, outbox + done, outbox_size - done);
+  outbox_size -= done;
+  return 1;
+}
+
+static int read_all(int sock, char *buf, size_t len) {
+  ssize_t got;
+
+  while (len) {
+    got = read(sock, buf, len);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) return 0;
+    buf += got;
+    len -= got;
+  }
+
+  return 1;
+}
+
+static char *next_string(char **scan) {
+  char *out = *scan;
+  *scan += strlen(out) + 1;
+  return out;
+}
+
+static void reap(void) {
+  struct rusage usage;
+  int status;
+  pid_t pid;
+
+  while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+    post(ZYGOTE_EXITED, pid, status, &usage);
+}
+
+// Receive one request and fork its job; returns 0 if wake has gone away
+static int spawn(int sock, const sigset_t *saved) {
+  struct zygote_request req;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(ZYGOTE_MAX_FDS*sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  struct sigaction sa;
+  int fds[ZYGOTE_MAX_FDS];
+  size_t nfds = 0, n, i;
+  char *body, *scan, *dir, *stdin_file, **argv, **envp;
+  ssize_t got;
+  pid_t pid;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &req;
+  iov.iov_len = sizeof(req);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  do got = recvmsg(sock, &msg, 0);
+  while (got == -1 && errno == EINTR);
+  if (got <= 0) return 0;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (i = 0; i < n; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+      if (nfds < ZYGOTE_MAX_FDS) fds[nfds++] = fd;
+      else close(fd);
+    }
+  }
+
+  if ((size_t)got < sizeof(req) && !read_all(sock, (char*)&req + got, sizeof(req) - got))
+    return 0;
+
+  if (nfds < 2 || nfds != req.fds) {
+    fprintf(stderr, "shim zygote: received %d of %d descriptors\n", (int)nfds, (int)req.fds);
+    exit(1);
+  }
+
+  body = malloc(req.bytes + 1);
+  argv = malloc((req.argc + 1) * sizeof(char*));
+  envp = malloc((req.envc + 1) * sizeof(char*));
+  if (!body || !argv || !envp) {
+    perror("shim zygote malloc");
+    exit(1);
+  }
+
+  if (!read_all(sock, body, req.bytes)) return 0;
+  body[req.bytes] = 0;
+
+  scan = body;
+  dir = next_string(&scan);
+  stdin_file = next_string(&scan);
+  for (i = 0; i < req.argc; ++i) argv[i] = next_string(&scan);
+  for (i = 0; i < req.envc; ++i) envp[i] = next_string(&scan);
+  argv[req.argc] = 0;
+  envp[req.envc] = 0;
+
+  pid = fork();
+  if (pid == 0) {
+    close(sock);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    for (i = 0; i < sizeof(ignored)/sizeof(ignored[0]); ++i)
+      sigaction(ignored[i], &sa, 0);
+    sigprocmask(SIG_SETMASK, saved, 0);
+
+    // Joining before exec means nothing the job starts can escape the cgroup.
+    // On failure, the job still runs; its accounting falls back to rusage.
+    if (nfds > 2) {
+      if (write(fds[2], "0", 1) != 1) { }
+      close(fds[2]);
+    }
+
+    environ = envp;
+    exit(req.argc ? run_job(dir, stdin_file, fds[0], fds[1], argv) : 1);
+  }
+
+  post(ZYGOTE_SPAWNED, pid == -1 ? -errno : pid, 0, 0);
+
+  for (i = 0; i < nfds; ++i) close(fds[i]);
+  free(body);
+  free(argv);
+  free(envp);
+
+  return 1;
+}
+
+int do_zygote(int sock) {
+  struct sigaction sa;
+  struct timespec nowait;
+  sigset_t block, saved, waiting;
+  fd_set rset, wset;
+  size_t i;
+  int ret;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  for (i = 0; i < sizeof(ignored)/sizeof(ignored[0]); ++i)
+    sigaction(ignored[i], &sa, 0);
+
+  // SIGCHLD interrupts pselect(); we keep it blocked everywhere else
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &saved);
+  sa.sa_handler = handle_SIGCHLD;
+  sa.sa_flags = SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, 0);
+
+  waiting = saved;
+  sigdelset(&waiting, SIGCHLD);
+  memset(&nowait, 0, sizeof(nowait));
+
+  post(ZYGOTE_READY, getpid(), 0, 0);
+  while (flush(sock)) {
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    FD_SET(sock, &rset);
+    if (outbox_size) FD_SET(sock, &wset);
+
+    ret = pselect(sock+1, &rset, &wset, 0, child_ready ? &nowait : 0, &waiting);
+    if (ret == -1) {
+      if (errno != EINTR) {
+        perror("shim zygote pselect");
+        return 1;
+      }
+      FD_ZERO(&rset);
+    }
+
+    child_ready = 0;
+    reap();
+
+    if (FD_ISSET(sock, &rset) && !spawn(sock, &saved)) break;
+  }
+
+  return 0;
+}
@@ -512,7 +512,8 @@ static std::unique_ptr<Expr> expand_patterns(const std::string &fnname, std::vec
           DefValue(LOCATION, std::move(gets[i-1]))));
         assert (out.second);
       }
-      Lambda *lam = new Lambda(rmap->body->location, "_ tuple_case", rmap.release());
+      Location rl = rmap->body->location;
+      Lambda *lam = new Lambda(rl, "_ tuple_case", rmap.release());
       lam->fnname = fnname;
       des->cases.emplace_back(lam);
       for (auto p = patterns.rbegin(); p != patterns.rend(); ++p) {
@@ -565,8 +566,9 @@ static std::unique_ptr<Expr> expand_patterns(const std::string &fnname, std::vec
       std::unique_ptr<Destruct> des(new Destruct(location, Boolean, new App(LOCATION,
         new VarRef(LOCATION, "_ guard"),
         new VarRef(LOCATION, "Unit@wake"))));
-      des->cases.emplace_back(new Lambda(guard_true->location, "_", guard_true.release()));
-      des->cases.emplace_back(new Lambda(guard_false->location, "_", guard_false.release()));
+      Location lt = guard_true->location, lf = guard_false->location;
+      des->cases.emplace_back(new Lambda(lt, "_", guard_true.release()));
+      des->cases.emplace_back(new Lambda(lf, "_", guard_false.release()));
       des->location = des->cases.front()->location;
       fmap->body = std::move(des);
       return std::unique_ptr<Expr>(std::move(fmap));
@@ -580,7 +582,8 @@ static PatternTree cons_lookup(ResolveBinding *binding, std::unique_ptr<Expr> &e
   if (ast.name == "_") {
     // no-op; unbound
   } else if (!ast.name.empty() && Lexer::isLower(ast.name.c_str())) {
-    Lambda *lambda = new Lambda(expr->location, ast.name, expr.release());
+    Location l = expr->location;
+    Lambda *lambda = new Lambda(l, ast.name, expr.release());
     if (ast.name.compare(0, 3, "_ k") != 0) lambda->token = ast.token;
     expr = std::unique_ptr<Expr>(lambda);
     out.var = 0; // bound
@@ -682,14 +685,16 @@ static std::unique_ptr<Expr> rebind_match(const std::string &fnname, ResolveBind
     std::unique_ptr<Expr> expr;
     if (true) {
       std::string cname = match->patterns.size() == 1 ? fnname : fnname + ".case"  + std::to_string(f);
-      expr = std::unique_ptr<Expr>(new Lambda(p.expr->location, "_", p.expr.release(), cname.c_str()));
+      Location l = p.expr->location;
+      expr = std::unique_ptr<Expr>(new Lambda(l, "_", p.expr.release(), cname.c_str()));
     }
     if (p.guard) {
       patterns.back().guard_location = p.guard->location;
       std::string gname = match->patterns.size() == 1 ? fnname : fnname + ".guard"  + std::to_string(f);
+      Location gl = p.guard->location;
       expr = std::unique_ptr<Expr>(new App(LOCATION,
         new App(LOCATION, new VarRef(LOCATION, "Pair@wake"), expr.release()),
-        new Lambda(p.guard->location, "_", p.guard.release(), gname.c_str())));
+        new Lambda(gl, "_", p.guard.release(), gname.c_str())));
     }
     patterns.back().tree = cons_lookup(binding, expr, p.pattern, multiarg);
     auto out = map->defs.insert(std::make_pair("_ f" + std::to_string(f), DefValue(LOCATION, std::move(expr))));
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "cgroup.h"
+#include "database.h"
+#include "sysload.h"
+
+// A job may use this multiple of its predicted memory before it is killed
+#define MEMORY_SLACK	2
+// ... but is always allowed at least this much (64MB)
+#define MEMORY_FLOOR	(64*1024*1024)
+
+// On exit, wait this long for the processes of killed jobs to leave their leaves
+#define RMDIR_ATTEMPTS	10
+#define RMDIR_GAP_US	20000
+
+struct JobCgroups::detail {
+  std::string root;  // the cgroup holding this wake's jobs ("" if disabled)
+  bool memory, io;   // controllers delegated to the job leaves
+  bool limit_memory;
+  std::vector<std::string> busy; // leaves which still had processes when collected
+};
+
+static bool write_file(const std::string &file, const std::string &value) {
+  int fd = open(file.c_str(), O_WRONLY|O_CLOEXEC);
+  if (fd == -1) return false;
+  bool ok = write(fd, value.data(), value.size()) == (ssize_t)value.size();
+  int err = errno;
+  close(fd);
+  errno = err;
+  return ok;
+}
+
+static std::string read_file(const std::string &file) {
+  std::ifstream f(file);
+  std::stringstream s;
+  s << f.rdbuf();
+  return s.str();
+}
+
+// Is 'word' in a whitespace separated list (like cgroup.controllers)?
+static bool has_word(const std::string &list, const char *word) {
+  std::stringstream s(list);
+  std::string x;
+  while (s >> x) if (x == word) return true;
+  return false;
+}
+
+JobCgroups::JobCgroups() : imp(new JobCgroups::detail) {
+  imp->memory = false;
+  imp->io = false;
+  imp->limit_memory = false;
+}
+
+JobCgroups::~JobCgroups() {
+  if (imp->root.empty()) return;
+  auto &busy = imp->busy;
+  for (int retry = 0; !busy.empty() && retry < RMDIR_ATTEMPTS; ++retry) {
+    if (retry > 0) usleep(RMDIR_GAP_US);
+    busy.erase(std::remove_if(busy.begin(), busy.end(),
+      [](const std::string &leaf) { return rmdir(leaf.c_str()) == 0 || errno == ENOENT; }), busy.end());
+  }
+  rmdir(imp->root.c_str());
+}
+
+bool JobCgroups::init(bool limit_memory, std::string &why) {
+  std::string own = get_cgroup_dir();
+  if (own.empty()) {
+    why = "cgroup v2 is not available";
+    return false;
+  }
+
+  // The memory and io controllers must be enabled for our children.
+  // This fails if our own cgroup contains processes (as wake does), unless it is
+  // the root or the controllers were already delegated (eg: systemd Delegate=yes).
+  std::string controllers = read_file(own + "/cgroup.controllers");
+  std::string subtree = own + "/cgroup.subtree_control";
+  for (const char *c : { "memory", "io" })
+    if (has_word(controllers, c) && !has_word(read_file(subtree), c))
+      write_file(subtree, std::string("+") + c);
+  std::string delegated = read_file(subtree);
+
+  std::string root = own + "/wake-" + std::to_string(getpid());
+  if (mkdir(root.c_str(), 0755) != 0) {
+    why = "mkdir " + root + ": " + strerror(errno);
+    return false;
+  }
+
+  imp->root = root;
+  imp->memory = has_word(delegated, "memory") && write_file(root + "/cgroup.subtree_control", "+memory");
+  imp->io = has_word(delegated, "io") && write_file(root + "/cgroup.subtree_control", "+io");
+  imp->limit_memory = limit_memory && imp->memory;
+
+  if (!imp->memory) why = "the memory controller is not delegated; memory is not measured or limited";
+  return true;
+}
+
+bool JobCgroups::enabled() const {
+  return !imp->root.empty();
+}
+
+int JobCgroups::create(long job, uint64_t predict_membytes) {
+  std::string leaf = imp->root + "/job-" + std::to_string(job);
+  if (mkdir(leaf.c_str(), 0755) != 0 && errno != EEXIST) return -1;
+
+  if (imp->limit_memory && predict_membytes > 0) {
+    uint64_t max = std::max(predict_membytes * MEMORY_SLACK, (uint64_t)MEMORY_FLOOR);
+    write_file(leaf + "/memory.max", std::to_string(max));
+    // A runaway job should be killed, not pushed into swap
+    write_file(leaf + "/memory.swap.max", "0");
+  }
+
+  return open((leaf + "/cgroup.procs").c_str(), O_WRONLY|O_CLOEXEC);
+}
+
+uint64_t JobCgroups::memory(long job) {
+  if (!imp->memory) return 0;
+  std::ifstream current(imp->root + "/job-" + std::to_string(job) + "/memory.current");
+  uint64_t bytes;
+  return current >> bytes ? bytes : 0;
+}
+
+// cgroup.freeze requires linux 5.2
+bool JobCgroups::freeze(long job, bool frozen) {
+  if (imp->root.empty()) return false;
+  return write_file(imp->root + "/job-" + std::to_string(job) + "/cgroup.freeze", frozen ? "1" : "0");
+}
+
+void JobCgroups::collect(long job, Usage &usage) {
+  std::string leaf = imp->root + "/job-" + std::to_string(job);
+  std::string key;
+
+  // usage_usec includes both user and system time of every process in the leaf
+  std::ifstream cpu(leaf + "/cpu.stat");
+  uint64_t usec;
+  while (cpu >> key >> usec)
+    if (key == "usage_usec")
+      usage.cputime = usec / 1000000.0;
+
+  if (imp->memory) {
+    // memory.peak requires linux 5.19
+    std::ifstream peak(leaf + "/memory.peak");
+    uint64_t bytes;
+    if (peak >> bytes) usage.membytes = bytes;
+  }
+
+  if (imp->io) {
+    // One line per device: "MAJ:MIN rbytes=N wbytes=N rios=N wios=N ..."
+    std::ifstream stat(leaf + "/io.stat");
+    std::string line;
+    uint64_t rbytes = 0, wbytes = 0;
+    while (std::getline(stat, line)) {
+      std::stringstream fields(line);
+      while (fields >> key) {
+        if (key.compare(0, 7, "rbytes=") == 0) rbytes += strtoull(key.c_str()+7, 0, 10);
+        if (key.compare(0, 7, "wbytes=") == 0) wbytes += strtoull(key.c_str()+7, 0, 10);
+      }
+    }
+    usage.ibytes = rbytes;
+    usage.obytes = wbytes;
+  }
+
+  // Processes the job left running keep the leaf alive; try again on exit
+  if (rmdir(leaf.c_str()) != 0) imp->busy.push_back(leaf);
+}
+
+void JobCgroups::release(long job) {
+  if (imp->root.empty()) return;
+  std::string leaf = imp->root + "/job-" + std::to_string(job);
+  if (rmdir(leaf.c_str()) != 0 && errno != ENOENT) imp->busy.push_back(leaf);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct Usage;
+
+// Runs each job in its own cgroup v2 leaf, under a cgroup created for this wake.
+// The leaf accounts for every process the job starts, unlike rusage of the child.
+struct JobCgroups {
+  struct detail;
+  std::unique_ptr<detail> imp;
+
+  JobCgroups();
+  ~JobCgroups(); // removes the cgroups which have emptied
+
+  // Setup requires a writable (delegated) cgroup; on failure, or if some features
+  // are unavailable, 'why' explains what is missing.
+  bool init(bool limit_memory, std::string &why);
+  bool enabled() const;
+
+  // Create the leaf for a job, returning its cgroup.procs opened for writing (or -1).
+  // With limit_memory, memory.max is set from the predicted memory use (if known).
+  int create(long job, uint64_t predict_membytes);
+
+  // Memory used by the leaf's processes right now; 0 if not measured
+  uint64_t memory(long job);
+
+  // Stop or resume every process in the leaf; false if the freezer is unavailable
+  bool freeze(long job, bool frozen);
+
+  // Replace the measured usage with the leaf's totals and remove the leaf
+  void collect(long job, Usage &usage);
+  // Remove the leaf of a job killed at exit, whose usage is not needed
+  void release(long job);
+};
+
+#endif
@@ -19,37 +19,95 @@
 #define _XOPEN_SOURCE 700
 #define _POSIX_C_SOURCE 200809L
 
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sqlite3.h>
+#include <zlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <unordered_set>
+#include <unordered_map>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
 
 #include "database.h"
 #include "status.h"
+#include "hash.h"
 
 // Increment every time the database schema changes
-#define SCHEMA_VERSION "1"
+#define SCHEMA_VERSION "5"
+// Older databases are converted, rather than rejected; those before BLOBS_VERSION
+// kept commandlines and environments in jobs (see migrate_blobs), and those before
+// PACKED_VERSION stored job output, stacks and environments raw (see migrate_packing)
+#define BLOBS_VERSION 3
+#define PACKED_VERSION 4
+// Spilled output is replayed to the terminal in pieces of this size
+#define SPILL_REPLAY_CHUNK (1024*1024)
+
+// Job output, stacks and environments are stored packed: a tag byte, then either
+// the raw value or (if it is at least PACK_MIN bytes and shrinks) its 32-bit length and zlib stream
+#define PACK_RAW 0
+#define PACK_ZLIB 1
+#define PACK_MIN 128
+#define PACK_LEVEL 6
 
 #define VISIBLE 0
 #define INPUT 1
 #define OUTPUT 2
+
+// Output existence checks for reuse_jobs use up to this many threads,
+// but only one per this many files; threads claim this many files at a time
+#define PROBE_THREADS 8
+#define PROBE_PER_THREAD 256
+#define PROBE_CHUNK 32
+
+// Job file lists are recorded this many rows per insert statement
+#define TREE_BATCH 64
+
+// Builds exclude one another by locking this byte of wake.db.
+// SQLite itself only locks [0x40000000, 0x40000200), so readers are unaffected.
+#define BUILD_LOCK_BYTE 0x40000400
+
+// A POSIX lock is dropped when the process closes any descriptor of the file, which sqlite does.
+// Where possible, lock the open file description instead.
+#ifdef F_OFD_SETLK
+#define BUILD_LOCK_CMD F_OFD_SETLK
+#else
+#define BUILD_LOCK_CMD F_SETLK
+#endif
+
 #define INDEXES 3
 
 struct Database::detail {
   bool debugdb;
   sqlite3 *db;
+  int lock_fd; // holds BUILD_LOCK_BYTE
   sqlite3_stmt *get_entropy;
   sqlite3_stmt *set_entropy;
   sqlite3_stmt *begin_txn;
   sqlite3_stmt *commit_txn;
   sqlite3_stmt *predict_job;
-  sqlite3_stmt *stats_job;
   sqlite3_stmt *insert_job;
+  sqlite3_stmt *find_blob;
+  sqlite3_stmt *insert_blob;
   sqlite3_stmt *insert_tree;
+  sqlite3_stmt *insert_trees;
+  sqlite3_stmt *find_file;
   sqlite3_stmt *insert_log;
   sqlite3_stmt *wipe_file;
   sqlite3_stmt *insert_file;
@@ -57,11 +115,13 @@ struct Database::detail {
   sqlite3_stmt *get_log;
   sqlite3_stmt *replay_log;
   sqlite3_stmt *get_tree;
+  sqlite3_stmt *clear_probes;
+  sqlite3_stmt *insert_probe;
   sqlite3_stmt *add_stats;
   sqlite3_stmt *link_stats;
   sqlite3_stmt *detect_overlap;
   sqlite3_stmt *delete_overlap;
-  sqlite3_stmt *find_prior;
+  sqlite3_stmt *find_priors;
   sqlite3_stmt *update_prior;
   sqlite3_stmt *delete_prior;
   sqlite3_stmt *find_job;
@@ -71,27 +131,263 @@ struct Database::detail {
   sqlite3_stmt *fetch_hash;
   sqlite3_stmt *delete_jobs;
   sqlite3_stmt *delete_dups;
+  sqlite3_stmt *delete_blobs;
   sqlite3_stmt *delete_stats;
   sqlite3_stmt *revtop_order;
+  sqlite3_stmt *crit_edges;
   sqlite3_stmt *setcrit_path;
   sqlite3_stmt *tag_job;
   sqlite3_stmt *get_tags;
   sqlite3_stmt *get_all_tags;
   sqlite3_stmt *get_edges;
+  sqlite3_stmt *next_job;
+  sqlite3_stmt *insert_spill;
+  sqlite3_stmt *get_spill;
+  sqlite3_stmt *all_spills;
+  sqlite3_stmt *prior_jobs;
+  sqlite3_stmt *forget_job;
 
   long run_id;
+  long next_job_id;
+  int txn_depth;
+
+  // Writes are queued for a background thread, which applies them in large transactions
+  std::thread writer;
+  std::mutex db_lock;    // held while using the sqlite3 connection
+  std::mutex queue_lock; // protects the fields below
+  std::condition_variable work, idle;
+  std::deque<std::function<void()> > queue;
+  bool async;           // writes are being queued (only changed by the main thread)
+  bool busy, quit, fatal;
+  std::string deferred;  // diagnostics from the writer thread, reported by the main thread
+  double write_seconds;  // spent applying writes (by the writer thread, if any)
+  double stall_seconds;  // spent by the main thread waiting for queued writes
+  double clean_seconds;  // spent in clean()
+
+  // Rows of files are never deleted, so their file_ids can be remembered while the database is open
+  std::unordered_map<std::string, long> file_ids; // path -> file_id (used with the sqlite3 connection)
+
+  // Dirs which held spilled output when the database was opened, swept even without --spill
+  std::set<std::string> spill_dirs;
+
+  // Outputs found by reuse_jobs are remembered for the run; wake's own writes forget them
+  std::map<std::string, bool> present; // path -> existed when checked
+  // Cold paths are checked by a pool of threads, started when a batch is large enough
+  std::vector<std::thread> checkers;
+  std::mutex check_lock; // protects the fields below
+  std::condition_variable check_work, check_done;
+  const std::vector<const std::string *> *check_paths;
+  std::vector<char> *check_ok;
+  std::atomic<size_t> check_next;
+  size_t check_round, check_busy;
+  bool check_quit;
+
   detail(bool debugdb_)
-   : debugdb(debugdb_), db(0), get_entropy(0), set_entropy(0), begin_txn(0),
-     commit_txn(0), predict_job(0), stats_job(0), insert_job(0), insert_tree(0), insert_log(0),
-     wipe_file(0), insert_file(0), update_file(0), get_log(0), replay_log(0), get_tree(0), add_stats(0),
-     link_stats(0), detect_overlap(0), delete_overlap(0), find_prior(0), update_prior(0), delete_prior(0),
+   : debugdb(debugdb_), db(0), lock_fd(-1), get_entropy(0), set_entropy(0), begin_txn(0),
+     commit_txn(0), predict_job(0), insert_job(0), find_blob(0), insert_blob(0), insert_tree(0), insert_trees(0),
+     find_file(0), insert_log(0),
+     wipe_file(0), insert_file(0), update_file(0), get_log(0), replay_log(0), get_tree(0), clear_probes(0), insert_probe(0), add_stats(0),
+     link_stats(0), detect_overlap(0), delete_overlap(0), find_priors(0), update_prior(0), delete_prior(0),
      find_job(0), find_owner(0), find_last(0), find_failed(0), fetch_hash(0), delete_jobs(0), delete_dups(0),
-     delete_stats(0), revtop_order(0), setcrit_path(0), tag_job(0), get_tags(0), get_all_tags(0), get_edges(0) { }
+     delete_blobs(0), delete_stats(0), revtop_order(0), crit_edges(0), setcrit_path(0), tag_job(0), get_tags(0), get_all_tags(0), get_edges(0),
+     next_job(0), insert_spill(0), get_spill(0), all_spills(0), prior_jobs(0),
+     forget_job(0), run_id(0), next_job_id(0), txn_depth(0), async(false), busy(false), quit(false), fatal(false),
+     write_seconds(0), stall_seconds(0), clean_seconds(0), check_paths(nullptr), check_ok(nullptr), check_next(0),
+     check_round(0), check_busy(0), check_quit(false) { }
 };
 
 Database::Database(bool debugdb) : imp(new detail(debugdb)) { }
 Database::~Database() { close(); }
 
+static std::string pack(const char *data, size_t len) {
+  std::string out;
+  if (len >= PACK_MIN && len <= 0xffffffffU) {
+    uLongf size = compressBound(len);
+    out.resize(5 + size);
+    out[0] = PACK_ZLIB;
+    for (int i = 0; i < 4; ++i) out[1+i] = (len >> (24-8*i)) & 0xff;
+    if (compress2(reinterpret_cast<Bytef*>(&out[5]), &size, reinterpret_cast<const Bytef*>(data), len, PACK_LEVEL) == Z_OK && 5 + size < len) {
+      out.resize(5 + size);
+      return out;
+    }
+  }
+  out.resize(1 + len);
+  out[0] = PACK_RAW;
+  memcpy(&out[1], data, len);
+  return out;
+}
+
+static std::string pack(const std::string &x) {
+  return pack(x.data(), x.size());
+}
+
+static std::string unpack(const char *data, size_t len) {
+  if (len >= 1 && data[0] == PACK_RAW) return std::string(data+1, len-1);
+  if (len < 5 || data[0] != PACK_ZLIB) {
+    std::cerr << "Could not unpack a value in wake.db; it is corrupt" << std::endl;
+    exit(1);
+  }
+  const unsigned char *head = reinterpret_cast<const unsigned char*>(data);
+  uLongf size = ((uLongf)head[1] << 24) | (head[2] << 16) | (head[3] << 8) | head[4];
+  std::string out(size, 0);
+  if (uncompress(reinterpret_cast<Bytef*>(&out[0]), &size, head+5, len-5) != Z_OK || size != out.size()) {
+    std::cerr << "Could not decompress a value in wake.db; it is corrupt" << std::endl;
+    exit(1);
+  }
+  return out;
+}
+
+static std::string unpack_column(sqlite3_stmt *stmt, int col) {
+  return unpack(
+    static_cast<const char*>(sqlite3_column_blob(stmt, col)),
+    sqlite3_column_bytes(stmt, col));
+}
+
+// Jobs are found by this hash of what identifies them, rather than by comparing every field
+static std::string job_identity(
+  const std::string &directory,
+  const std::string &commandline,
+  const std::string &environment,
+  const std::string &stdin_file)
+{
+  std::vector<uint64_t> parts;
+  Hash(directory).push(parts);
+  Hash(commandline).push(parts);
+  Hash(environment).push(parts);
+  Hash(stdin_file).push(parts);
+  Hash identity(parts);
+  return std::string(reinterpret_cast<const char*>(&identity.data[0]), sizeof(identity.data));
+}
+
+// Rebuild jobs in the current layout, with each distinct commandline and environment in blobs.
+// log is rebuilt too, as its output column became a blob. Values stay raw for migrate_packing.
+static std::string migrate_blobs(sqlite3 *db, const char *schema_sql) {
+  const char *rename =
+    "alter table jobs rename to old_jobs;"
+    "drop index job;"
+    "alter table log rename to old_log;"
+    "drop index logorder;";
+  const char *copy_jobs =
+    "select job_id, run_id, use_id, label, directory, commandline, environment, stdin,"
+    " signature, stack, stat_id, endtime, keep from old_jobs";
+  const char *insert_job =
+    "insert into jobs(job_id, run_id, use_id, label, directory, commandline, environment, stdin,"
+    " signature, stack, stat_id, endtime, keep, identity)"
+    " values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+  const char *insert_blob =
+    "insert into blobs(hash, content) values(?, ?)";
+  const char *finish =
+    "insert into log(log_id, job_id, descriptor, seconds, output)"
+    " select log_id, job_id, descriptor, seconds, output from old_log;"
+    "drop table old_log;"
+    "drop table old_jobs;";
+
+  std::cerr << "Upgrading wake.db to share commandlines and environments; this happens only once ..." << std::endl;
+  // The tables which reference jobs and log must keep doing so while they are replaced
+  sqlite3_exec(db, "pragma foreign_keys=off; pragma legacy_alter_table=on;", 0, 0, 0);
+  std::string out;
+  if (sqlite3_exec(db, "begin transaction", 0, 0, 0) != SQLITE_OK) {
+    out = std::string("could not convert: ") + sqlite3_errmsg(db);
+    sqlite3_exec(db, "pragma legacy_alter_table=off; pragma foreign_keys=on;", 0, 0, 0);
+    return out;
+  }
+
+  sqlite3_stmt *select = 0, *insert = 0, *blob = 0;
+  if (sqlite3_exec(db, rename, 0, 0, 0) != SQLITE_OK ||
+      sqlite3_exec(db, schema_sql, 0, 0, 0) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, copy_jobs, -1, &select, 0) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, insert_job, -1, &insert, 0) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, insert_blob, -1, &blob, 0) != SQLITE_OK) {
+    out = std::string("could not convert: ") + sqlite3_errmsg(db);
+  }
+
+  // A commandline and an environment never share a blob, as only environments get packed
+  std::map<std::string, long> ids[2];
+  auto intern = [&](int kind, const std::string &raw) -> long {
+    auto it = ids[kind].find(raw);
+    if (it != ids[kind].end()) return it->second;
+    sqlite3_bind_int64(blob, 1, static_cast<long>(Hash(raw).data[0]));
+    sqlite3_bind_blob(blob, 2, raw.data(), raw.size(), SQLITE_STATIC);
+    if (sqlite3_step(blob) != SQLITE_DONE)
+      out = std::string("could not convert: ") + sqlite3_errmsg(db);
+    sqlite3_reset(blob);
+    return ids[kind][raw] = sqlite3_last_insert_rowid(db);
+  };
+  auto column = [&](int col) {
+    return std::string(
+      static_cast<const char*>(sqlite3_column_blob(select, col)),
+      sqlite3_column_bytes(select, col));
+  };
+
+  while (out.empty() && sqlite3_step(select) == SQLITE_ROW) {
+    std::string directory   = column(4);
+    std::string commandline = column(5);
+    std::string environment = column(6);
+    std::string stdin_file  = column(7);
+    std::string identity = job_identity(directory, commandline, environment, stdin_file);
+    for (int i = 0; i < 13; ++i)
+      sqlite3_bind_value(insert, i+1, sqlite3_column_value(select, i));
+    sqlite3_bind_int64(insert, 6, intern(0, commandline));
+    sqlite3_bind_int64(insert, 7, intern(1, environment));
+    sqlite3_bind_blob(insert, 14, identity.data(), identity.size(), SQLITE_STATIC);
+    if (out.empty() && sqlite3_step(insert) != SQLITE_DONE)
+      out = std::string("could not convert: ") + sqlite3_errmsg(db);
+    sqlite3_reset(insert);
+  }
+  sqlite3_finalize(select);
+  sqlite3_finalize(insert);
+  sqlite3_finalize(blob);
+
+  if (out.empty() && sqlite3_exec(db, finish, 0, 0, 0) != SQLITE_OK)
+    out = std::string("could not convert: ") + sqlite3_errmsg(db);
+
+  sqlite3_exec(db, out.empty() ? "commit transaction" : "rollback transaction", 0, 0, 0);
+  sqlite3_exec(db, "pragma legacy_alter_table=off; pragma foreign_keys=on;", 0, 0, 0);
+  return out;
+}
+
+// Databases before PACKED_VERSION stored the packed columns raw; rewrite them in one transaction
+static std::string migrate_packing(sqlite3 *db) {
+  struct Column { const char *select, *update; };
+  static const Column columns[] = {
+    { "select log_id, output from log",
+      "update log set output=?1 where log_id=?2" },
+    { "select job_id, stack from jobs",
+      "update jobs set stack=?1 where job_id=?2" },
+    { "select blob_id, content from blobs where blob_id in (select environment from jobs)",
+      "update blobs set content=?1 where blob_id=?2" }};
+
+  std::cerr << "Compressing job output in wake.db; this happens only once ..." << std::endl;
+  std::string out;
+  if (sqlite3_exec(db, "begin transaction", 0, 0, 0) != SQLITE_OK)
+    return std::string("could not convert: ") + sqlite3_errmsg(db);
+
+  for (auto &c : columns) {
+    sqlite3_stmt *select = 0, *update = 0;
+    if (sqlite3_prepare_v2(db, c.select, -1, &select, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, c.update, -1, &update, 0) != SQLITE_OK) {
+      out = std::string("could not convert: ") + sqlite3_errmsg(db);
+    } else {
+      while (out.empty() && sqlite3_step(select) == SQLITE_ROW) {
+        std::string packed = pack(
+          static_cast<const char*>(sqlite3_column_blob(select, 1)),
+          sqlite3_column_bytes(select, 1));
+        sqlite3_bind_blob(update, 1, packed.data(), packed.size(), SQLITE_STATIC);
+        sqlite3_bind_int64(update, 2, sqlite3_column_int64(select, 0));
+        if (sqlite3_step(update) != SQLITE_DONE)
+          out = std::string("could not convert: ") + sqlite3_errmsg(db);
+        sqlite3_reset(update);
+      }
+    }
+    sqlite3_finalize(select);
+    sqlite3_finalize(update);
+    if (!out.empty()) break;
+  }
+
+  sqlite3_exec(db, out.empty() ? "commit transaction" : "rollback transaction", 0, 0, 0);
+  return out;
+}
+
 static int schema_cb(void *data, int columns, char **values, char **labels) {
   // values[0] = 0 if a fresh DB
   // values[1] = schema version
@@ -108,11 +404,52 @@ static int schema_cb(void *data, int columns, char **values, char **labels) {
   // Matching version? Ok to use it
   if (!strcmp(values[1], SCHEMA_VERSION)) return 0;
 
+  // Older versions hold the same information, so convert them
+  int version = atoi(values[1]);
+  if (version >= 1 && version < atoi(SCHEMA_VERSION)) {
+    *static_cast<int*>(data) = version;
+    return 0;
+  }
+
   // Versions do not match
   return -1;
 }
 
-std::string Database::open(bool wait, bool memory) {
+static std::string lock_builds(Database::detail *imp, bool wait) {
+  imp->lock_fd = ::open("wake.db", O_RDWR | O_CLOEXEC);
+  if (imp->lock_fd == -1) return std::string("open: ") + strerror(errno);
+
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = BUILD_LOCK_BYTE;
+  lock.l_len = 1;
+
+  bool waiting = false;
+  while (fcntl(imp->lock_fd, BUILD_LOCK_CMD, &lock) != 0) {
+    if ((errno != EACCES && errno != EAGAIN) || !wait) {
+      std::string out = errno == EACCES || errno == EAGAIN ? "another build is using it" : strerror(errno);
+      if (waiting) std::cerr << std::endl;
+      return out;
+    }
+    if (waiting) {
+      std::cerr << ".";
+    } else {
+      waiting = true;
+      std::cerr << "Database wake.db is busy; waiting .";
+    }
+    sleep(1);
+  }
+
+  if (waiting) std::cerr << std::endl;
+  return "";
+}
+
+static void finish_stmt(const char *why, sqlite3_stmt *stmt, bool debug);
+static std::string rip_column(sqlite3_stmt *stmt, int col);
+
+std::string Database::open(bool wait, bool memory, bool readonly) {
   if (imp->db) return "";
   int ret;
 
@@ -130,13 +467,25 @@ std::string Database::open(bool wait, bool memory) {
   }
 #endif
 
-  // Increment the SCHEMA_VERSION every time the below string changes.
-  const char *schema_sql =
+  // Only one build may use the database at a time, but readers can query it while a build runs.
+  // So sqlite locks normally (sharing the WAL index) and builds take a lock of their own.
+  if (!memory && !readonly) {
+    std::string out = lock_builds(imp.get(), wait);
+    if (!out.empty()) {
+      close();
+      return out;
+    }
+  }
+
+  const char *pragma_sql =
     "pragma auto_vacuum=incremental;"
     "pragma journal_mode=wal;"
     "pragma synchronous=0;"
-    "pragma locking_mode=exclusive;"
-    "pragma foreign_keys=on;"
+    "pragma foreign_keys=on;";
+
+  // Increment the SCHEMA_VERSION every time the below string changes.
+  // It is also run by migrate_blobs, within a transaction, so it must not contain pragmas.
+  const char *schema_sql =
     "create table if not exists schema("
     "  version integer primary key);"
     "create table if not exists entropy("
@@ -162,21 +511,27 @@ std::string Database::open(bool wait, bool memory) {
     "  obytes     integer not null,"
     "  pathtime   real);"
     "create index if not exists stathash on stats(hashcode);"
+    "create table if not exists blobs(" // commandlines and environments, shared by the jobs which use them
+    "  blob_id integer primary key,"
+    "  hash    integer not null,"
+    "  content blob    not null);"
+    "create index if not exists blobhash on blobs(hash);"
     "create table if not exists jobs("
     "  job_id      integer primary key autoincrement,"
     "  run_id      integer not null references runs(run_id),"
     "  use_id      integer not null references runs(run_id),"
     "  label       text    not null,"
     "  directory   text    not null,"
-    "  commandline blob    not null,"
-    "  environment blob    not null,"
+    "  commandline integer not null," // blob_id; not a foreign key, so cleaning blobs needs no index
+    "  environment integer not null," // blob_id
     "  stdin       text    not null," // might point outside the workspace
+    "  identity    blob    not null," // hash(directory, commandline, environment, stdin)
     "  signature   integer not null," // hash(FnInputs, FnOutputs, Resources, Keep)
     "  stack       blob    not null,"
     "  stat_id     integer references stats(stat_id)," // null if unmerged
     "  endtime     text    not null default '',"
     "  keep        integer not null default 0);"       // 0=false, 1=true
-    "create index if not exists job on jobs(directory, commandline, environment, stdin, signature, keep, job_id, stat_id);"
+    "create index if not exists job on jobs(identity, signature, keep, job_id, stat_id);"
     "create table if not exists filetree("
     "  tree_id  integer primary key autoincrement,"
     "  access   integer not null," // 0=visible, 1=input, 2=output
@@ -189,8 +544,15 @@ std::string Database::open(bool wait, bool memory) {
     "  job_id     integer not null references jobs(job_id) on delete cascade,"
     "  descriptor integer not null," // 1=stdout, 2=stderr"
     "  seconds    real    not null," // seconds after job start
-    "  output     text    not null);"
+    "  output     blob    not null);"
     "create index if not exists logorder on log(job_id, descriptor, log_id);"
+    "create table if not exists spills(" // output beyond the log, kept in a file (see --spill)
+    "  job_id     integer not null references jobs(job_id) on delete cascade,"
+    "  descriptor integer not null," // 1=stdout, 2=stderr
+    "  path       text    not null," // named by the hash of its content
+    "  bytes      integer not null,"
+    "  tail       text    not null," // the last output, in case the file is lost
+    "  unique(job_id, descriptor) on conflict replace);"
     "create table if not exists tags("
     "  job_id  integer not null references jobs(job_id) on delete cascade,"
     "  uri     text,"
@@ -200,7 +562,8 @@ std::string Database::open(bool wait, bool memory) {
   bool waiting = false;
   while (true) {
     char *fail;
-    ret = sqlite3_exec(imp->db, schema_sql, 0, 0, &fail);
+    ret = sqlite3_exec(imp->db, pragma_sql, 0, 0, &fail);
+    if (ret == SQLITE_OK) ret = sqlite3_exec(imp->db, schema_sql, 0, 0, &fail);
     if (ret == SQLITE_OK) {
       if (waiting) {
         std::cerr << std::endl;
@@ -208,8 +571,22 @@ std::string Database::open(bool wait, bool memory) {
       // Use an empty entropy table as a proxy for a new database (it gets filled automatically)
       const char *get_version = "select (select count(row_id) from entropy), (select max(version) from schema);";
       const char *set_version = "insert or ignore into schema(version) values(" SCHEMA_VERSION ");";
-      ret = sqlite3_exec(imp->db, get_version, &schema_cb, 0, 0);
+      int version = 0; // of an older database, which must be converted
+      ret = sqlite3_exec(imp->db, get_version, &schema_cb, &version, 0);
       if (ret == SQLITE_OK) {
+        // Readers leave the database as they found it, so a build may be using it
+        if (readonly) {
+          if (!version) break;
+          close();
+          return "produced by an older version of wake; run a build to upgrade it.";
+        }
+        std::string why;
+        if (version && version < BLOBS_VERSION) why = migrate_blobs(imp->db, schema_sql);
+        if (version && version < PACKED_VERSION && why.empty()) why = migrate_packing(imp->db);
+        if (!why.empty()) {
+          close();
+          return why;
+        }
         sqlite3_exec(imp->db, set_version, 0, 0, 0);
         break;
       } else {
@@ -237,6 +614,18 @@ std::string Database::open(bool wait, bool memory) {
     }
   }
 
+  // reuse_jobs resolves a whole batch with one query, by joining these against jobs
+  const char *probe_sql =
+    "create temp table if not exists probes("
+    "  probe_id  integer primary key,"
+    "  identity  blob    not null,"
+    "  signature integer not null);";
+  if (sqlite3_exec(imp->db, probe_sql, 0, 0, 0) != SQLITE_OK) {
+    std::string out = std::string("could not create temp.probes: ") + sqlite3_errmsg(imp->db);
+    close();
+    return out;
+  }
+
   // prepare statements
   const char *sql_get_entropy = "select seed from entropy order by row_id";
   const char *sql_set_entropy = "insert into entropy(seed) values(?)";
@@ -245,15 +634,20 @@ std::string Database::open(bool wait, bool memory) {
   const char *sql_predict_job =
     "select status, runtime, cputime, membytes, ibytes, obytes, pathtime"
     " from stats where hashcode=? order by stat_id desc limit 1";
-  const char *sql_stats_job =
-    "select status, runtime, cputime, membytes, ibytes, obytes, pathtime"
-    " from stats where stat_id=?";
   const char *sql_insert_job =
-    "insert into jobs(run_id, use_id, label, directory, commandline, environment, stdin, signature, stack)"
-    " values(?, ?1, ?, ?, ?, ?, ?, ?, ?)";
+    "insert into jobs(job_id, run_id, use_id, label, directory, commandline, environment, stdin, signature, stack, identity)"
+    " values(?, ?, ?2, ?, ?, ?, ?, ?, ?, ?, ?)";
+  const char *sql_find_blob =
+    "select blob_id from blobs where hash=? and content=?";
+  const char *sql_insert_blob =
+    "insert into blobs(hash, content) values(?, ?)";
   const char *sql_insert_tree =
-    "insert into filetree(access, job_id, file_id)"
-    " values(?, ?, (select file_id from files where path=?))";
+    "insert into filetree(access, job_id, file_id) values(?, ?, ?)";
+  std::string sql_insert_trees = "insert into filetree(access, job_id, file_id) values(?1, ?2, ?3)";
+  for (int i = 1; i < TREE_BATCH; ++i)
+    sql_insert_trees += ", (?1, ?2, ?" + std::to_string(i+3) + ")";
+  const char *sql_find_file =
+    "select file_id from files where path=?";
   const char *sql_insert_log =
     "insert into log(job_id, descriptor, seconds, output)"
     " values(?, ?, ?, ?)";
@@ -272,6 +666,10 @@ std::string Database::open(bool wait, bool memory) {
   const char *sql_get_tree =
     "select f.path, f.hash from filetree t, files f"
     " where t.job_id=? and t.access=? and f.file_id=t.file_id order by t.tree_id";
+  const char *sql_clear_probes =
+    "delete from temp.probes";
+  const char *sql_insert_probe =
+    "insert into temp.probes(probe_id, identity, signature) values(?, ?, ?)";
   const char *sql_add_stats =
     "insert into stats(hashcode, status, runtime, cputime, membytes, ibytes, obytes)"
     " values(?, ?, ?, ?, ?, ?, ?)";
@@ -284,32 +682,39 @@ std::string Database::open(bool wait, bool memory) {
     "delete from jobs where use_id<>? and job_id in "
     "(select t2.job_id from filetree t1, filetree t2"
     "  where t1.job_id=?2 and t1.access=2 and t2.file_id=t1.file_id and t2.access=2 and t2.job_id<>?2)";
-  const char *sql_find_prior =
-    "select job_id, stat_id from jobs where "
-    "directory=? and commandline=? and environment=? and stdin=? and signature=? and keep=1";
+  const char *sql_find_priors =
+    "select p.probe_id, j.job_id, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes, s.pathtime,"
+    " t.access, f.path, f.hash"
+    " from temp.probes p"
+    " join jobs j on j.identity=p.identity and j.signature=p.signature and j.keep=1"
+    " join stats s on s.stat_id=j.stat_id"
+    " left join filetree t on t.job_id=j.job_id and t.access in (1, 2)"
+    " left join files f on f.file_id=t.file_id"
+    " order by p.probe_id, j.job_id, t.access, t.tree_id";
   const char *sql_update_prior =
     "update jobs set use_id=? where job_id=?";
   const char *sql_delete_prior =
     "delete from jobs where use_id<>?1 and job_id in"
     " (select j2.job_id from jobs j1, jobs j2"
-    "  where j1.job_id=?2 and j1.directory=j2.directory and j1.commandline=j2.commandline"
-    "  and j1.environment=j2.environment and j1.stdin=j2.stdin and j2.job_id<>?2)";
+    "  where j1.job_id=?2 and j1.identity=j2.identity and j2.job_id<>?2)";
   const char *sql_find_job =
-    "select j.job_id, j.label, j.directory, j.commandline, j.environment, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
-    " from  jobs j left join stats s on j.stat_id=s.stat_id"
-    " where j.job_id=?";
+    "select j.job_id, j.label, j.directory, c.content, e.content, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
+    " from  jobs j left join stats s on j.stat_id=s.stat_id, blobs c, blobs e"
+    " where j.job_id=? and c.blob_id=j.commandline and e.blob_id=j.environment";
   const char *sql_find_owner =
-    "select j.job_id, j.label, j.directory, j.commandline, j.environment, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
-    " from files f, filetree t, jobs j left join stats s on j.stat_id=s.stat_id"
-    " where f.path=? and t.file_id=f.file_id and t.access=? and j.job_id=t.job_id order by j.job_id";
+    "select j.job_id, j.label, j.directory, c.content, e.content, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
+    " from files f, filetree t, jobs j left join stats s on j.stat_id=s.stat_id, blobs c, blobs e"
+    " where f.path=? and t.file_id=f.file_id and t.access=? and j.job_id=t.job_id"
+    " and c.blob_id=j.commandline and e.blob_id=j.environment order by j.job_id";
   const char *sql_find_last =
-    "select j.job_id, j.label, j.directory, j.commandline, j.environment, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
-    " from jobs j left join stats s on j.stat_id=s.stat_id"
-    " where j.run_id==(select max(run_id) from jobs) and substr(cast(commandline as text),1,1) <> '<' order by j.job_id";
+    "select j.job_id, j.label, j.directory, c.content, e.content, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
+    " from jobs j left join stats s on j.stat_id=s.stat_id, blobs c, blobs e"
+    " where j.run_id==(select max(run_id) from jobs) and c.blob_id=j.commandline and e.blob_id=j.environment"
+    " and substr(cast(c.content as text),1,1) <> '<' order by j.job_id";
   const char *sql_find_failed =
-    "select j.job_id, j.label, j.directory, j.commandline, j.environment, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
-    " from jobs j left join stats s on j.stat_id=s.stat_id"
-    " where s.status<>0 order by j.job_id";
+    "select j.job_id, j.label, j.directory, c.content, e.content, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
+    " from jobs j left join stats s on j.stat_id=s.stat_id, blobs c, blobs e"
+    " where s.status<>0 and c.blob_id=j.commandline and e.blob_id=j.environment order by j.job_id";
   const char *sql_fetch_hash =
     "select hash from files where path=? and modified=?";
   const char *sql_delete_jobs =
@@ -319,18 +724,22 @@ std::string Database::open(bool wait, bool memory) {
     "delete from stats where stat_id in"
     " (select stat_id from (select hashcode, count(*) as num, max(stat_id) as keep from stats group by hashcode) d, stats s"
     "  where d.num>1 and s.hashcode=d.hashcode and s.stat_id<>d.keep except select stat_id from jobs)";
+  const char *sql_delete_blobs =
+    "delete from blobs where blob_id not in (select commandline from jobs union select environment from jobs)";
   const char *sql_delete_stats =
     "delete from stats where stat_id in"
     " (select stat_id from stats"
     "  where stat_id not in (select stat_id from jobs)"
     "  order by stat_id desc limit 9999999 offset 4*(select count(*) from jobs))";
   const char *sql_revtop_order =
-    "select job_id from jobs where use_id=(select max(run_id) from runs) order by job_id desc";
+    "select j.job_id, j.stat_id, s.runtime from jobs j, stats s"
+    " where j.use_id=(select max(run_id) from runs) and s.stat_id=j.stat_id order by j.job_id desc";
+  const char *sql_crit_edges = // every job of this run, with the jobs which read its outputs
+    "select f1.job_id, f2.job_id, coalesce(s.pathtime, 0) from jobs p, filetree f1, filetree f2, jobs j, stats s"
+    " where p.use_id=(select max(run_id) from runs) and f1.job_id=p.job_id and f1.access=2"
+    " and f2.file_id=f1.file_id and f2.access=1 and j.job_id=f2.job_id and s.stat_id=j.stat_id";
   const char *sql_setcrit_path =
-    "update stats set pathtime=runtime+("
-    "  select coalesce(max(s.pathtime),0) from filetree f1, filetree f2, jobs j, stats s"
-    "  where f1.job_id=?1 and f1.access=2 and f1.file_id=f2.file_id and f2.access=1 and f2.job_id=j.job_id and j.stat_id=s.stat_id"
-    ") where stat_id=(select stat_id from jobs where job_id=?1)";
+    "update stats set pathtime=? where stat_id=?";
   const char *sql_tag_job =
     "insert into tags(job_id, uri, content) values(?, ?, ?)";
   const char *sql_get_tags =
@@ -341,6 +750,22 @@ std::string Database::open(bool wait, bool memory) {
     "select distinct user.job_id as user, used.job_id as used"
     "  from filetree user, filetree used"
     "   where user.access=1 and user.file_id=used.file_id and used.access=2";
+  const char *sql_next_job =
+    "select coalesce((select seq from sqlite_sequence where name='jobs'), 0)";
+  const char *sql_insert_spill =
+    "insert into spills(job_id, descriptor, path, bytes, tail) values(?, ?, ?, ?, ?)";
+  const char *sql_get_spill =
+    "select path, bytes, tail from spills where job_id=? and descriptor=?";
+  const char *sql_all_spills =
+    "select distinct path from spills";
+  const char *sql_prior_jobs =
+    "select j.job_id, j.label, j.directory, c.content, e.content, j.stdin, j.signature, j.stack, coalesce(s.pathtime, s.runtime)"
+    " from jobs j, stats s, blobs c, blobs e"
+    " where j.use_id=(select max(use_id) from jobs) and j.keep=1 and s.stat_id=j.stat_id and s.status=0"
+    " and c.blob_id=j.commandline and e.blob_id=j.environment"
+    " and substr(cast(c.content as text),1,1) <> '<' order by coalesce(s.pathtime, s.runtime) desc";
+  const char *sql_forget_job =
+    "delete from jobs where job_id=?";
 
 #define PREPARE(sql, member)										\
   ret = sqlite3_prepare_v2(imp->db, sql, -1, &imp->member, 0);						\
@@ -355,9 +780,12 @@ std::string Database::open(bool wait, bool memory) {
   PREPARE(sql_begin_txn,      begin_txn);
   PREPARE(sql_commit_txn,     commit_txn);
   PREPARE(sql_predict_job,    predict_job);
-  PREPARE(sql_stats_job,      stats_job);
   PREPARE(sql_insert_job,     insert_job);
+  PREPARE(sql_find_blob,      find_blob);
+  PREPARE(sql_insert_blob,    insert_blob);
   PREPARE(sql_insert_tree,    insert_tree);
+  PREPARE(sql_insert_trees.c_str(), insert_trees);
+  PREPARE(sql_find_file,      find_file);
   PREPARE(sql_insert_log,     insert_log);
   PREPARE(sql_wipe_file,      wipe_file);
   PREPARE(sql_insert_file,    insert_file);
@@ -365,11 +793,13 @@ std::string Database::open(bool wait, bool memory) {
   PREPARE(sql_get_log,        get_log);
   PREPARE(sql_replay_log,     replay_log);
   PREPARE(sql_get_tree,       get_tree);
+  PREPARE(sql_clear_probes,   clear_probes);
+  PREPARE(sql_insert_probe,   insert_probe);
   PREPARE(sql_add_stats,      add_stats);
   PREPARE(sql_link_stats,     link_stats);
   PREPARE(sql_detect_overlap, detect_overlap);
   PREPARE(sql_delete_overlap, delete_overlap);
-  PREPARE(sql_find_prior,     find_prior);
+  PREPARE(sql_find_priors,    find_priors);
   PREPARE(sql_update_prior,   update_prior);
   PREPARE(sql_delete_prior,   delete_prior);
   PREPARE(sql_find_job,       find_job);
@@ -379,20 +809,42 @@ std::string Database::open(bool wait, bool memory) {
   PREPARE(sql_fetch_hash,     fetch_hash);
   PREPARE(sql_delete_jobs,    delete_jobs);
   PREPARE(sql_delete_dups,    delete_dups);
+  PREPARE(sql_delete_blobs,   delete_blobs);
   PREPARE(sql_delete_stats,   delete_stats);
   PREPARE(sql_revtop_order,   revtop_order);
+  PREPARE(sql_crit_edges,     crit_edges);
   PREPARE(sql_setcrit_path,   setcrit_path);
   PREPARE(sql_tag_job,        tag_job);
   PREPARE(sql_get_tags,       get_tags);
   PREPARE(sql_get_all_tags,   get_all_tags);
   PREPARE(sql_get_edges,      get_edges);
+  PREPARE(sql_next_job,       next_job);
+  PREPARE(sql_insert_spill,   insert_spill);
+  PREPARE(sql_get_spill,      get_spill);
+  PREPARE(sql_all_spills,     all_spills);
+  PREPARE(sql_prior_jobs,     prior_jobs);
+  PREPARE(sql_forget_job,     forget_job);
+
+  // Jobs deleted by this run take their spills rows with them, so remember where the files are
+  while (sqlite3_step(imp->all_spills) == SQLITE_ROW) {
+    std::string path = rip_column(imp->all_spills, 0);
+    size_t slash = path.find_last_of('/');
+    imp->spill_dirs.insert(slash == std::string::npos ? "." : path.substr(0, slash));
+  }
+  finish_stmt("Could not list spilled job output", imp->all_spills, imp->debugdb);
 
   return "";
 }
 
+static void stop_writer(Database::detail *imp);
+static void stop_checkers(Database::detail *imp);
+
 void Database::close() {
   int ret;
 
+  stop_writer(imp.get());
+  stop_checkers(imp.get());
+
 #define FINALIZE(member)						\
   if  (imp->member) {							\
     ret = sqlite3_finalize(imp->member);				\
@@ -409,9 +861,12 @@ void Database::close() {
   FINALIZE(begin_txn);
   FINALIZE(commit_txn);
   FINALIZE(predict_job);
-  FINALIZE(stats_job);
   FINALIZE(insert_job);
+  FINALIZE(find_blob);
+  FINALIZE(insert_blob);
   FINALIZE(insert_tree);
+  FINALIZE(insert_trees);
+  FINALIZE(find_file);
   FINALIZE(insert_log);
   FINALIZE(wipe_file);
   FINALIZE(insert_file);
@@ -419,11 +874,13 @@ void Database::close() {
   FINALIZE(get_log);
   FINALIZE(replay_log);
   FINALIZE(get_tree);
+  FINALIZE(clear_probes);
+  FINALIZE(insert_probe);
   FINALIZE(add_stats);
   FINALIZE(link_stats);
   FINALIZE(detect_overlap);
   FINALIZE(delete_overlap);
-  FINALIZE(find_prior);
+  FINALIZE(find_priors);
   FINALIZE(update_prior);
   FINALIZE(delete_prior);
   FINALIZE(find_job);
@@ -433,13 +890,21 @@ void Database::close() {
   FINALIZE(fetch_hash);
   FINALIZE(delete_jobs);
   FINALIZE(delete_dups);
+  FINALIZE(delete_blobs);
   FINALIZE(delete_stats);
   FINALIZE(revtop_order);
+  FINALIZE(crit_edges);
   FINALIZE(setcrit_path);
   FINALIZE(tag_job);
   FINALIZE(get_tags);
   FINALIZE(get_all_tags);
   FINALIZE(get_edges);
+  FINALIZE(next_job);
+  FINALIZE(insert_spill);
+  FINALIZE(get_spill);
+  FINALIZE(all_spills);
+  FINALIZE(prior_jobs);
+  FINALIZE(forget_job);
 
   if (imp->db) {
     int ret = sqlite3_close(imp->db);
@@ -449,6 +914,12 @@ void Database::close() {
     }
   }
   imp->db = 0;
+  imp->file_ids.clear();
+
+  if (imp->lock_fd != -1) {
+    ::close(imp->lock_fd);
+    imp->lock_fd = -1;
+  }
 }
 
 static void finish_stmt(const char *why, sqlite3_stmt *stmt, bool debug) {
@@ -552,11 +1023,118 @@ static std::string rip_column(sqlite3_stmt *stmt, int col) {
     sqlite3_column_bytes(stmt, col));
 }
 
+// Transactions nest; only the outermost begin/commit reaches sqlite
+static void txn_begin(Database::detail *imp) {
+  if (imp->txn_depth++ == 0)
+    single_step("Could not begin a transaction", imp->begin_txn, imp->debugdb);
+}
+
+static void txn_end(Database::detail *imp) {
+  if (--imp->txn_depth == 0)
+    single_step("Could not commit a transaction", imp->commit_txn, imp->debugdb);
+}
+
+static double elapsed(const struct timeval &start) {
+  struct timeval now;
+  gettimeofday(&now, 0);
+  return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+// Everything queued while the writer is busy becomes a single transaction
+static void write_loop(Database::detail *imp) {
+  std::unique_lock<std::mutex> queue(imp->queue_lock);
+  while (true) {
+    imp->work.wait(queue, [imp] { return imp->quit || !imp->queue.empty(); });
+    if (imp->queue.empty()) return;
+
+    std::deque<std::function<void()> > batch;
+    batch.swap(imp->queue);
+    imp->busy = true;
+    queue.unlock();
+
+    struct timeval start;
+    gettimeofday(&start, 0);
+    {
+      std::lock_guard<std::mutex> hold(imp->db_lock);
+      txn_begin(imp);
+      for (auto &op : batch) op();
+      txn_end(imp);
+    }
+    double spent = elapsed(start);
+
+    queue.lock();
+    imp->write_seconds += spent;
+    imp->busy = false;
+    imp->idle.notify_all();
+  }
+}
+
+// Queue a write for the writer thread; without one, perform it immediately
+static void submit(Database::detail *imp, std::function<void()> &&op) {
+  if (!imp->async) {
+    struct timeval start;
+    gettimeofday(&start, 0);
+    op();
+    imp->write_seconds += elapsed(start);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> queue(imp->queue_lock);
+    imp->queue.emplace_back(std::move(op));
+  }
+  imp->work.notify_one();
+}
+
+// Wait for all queued writes to land, so that reads observe them
+static void barrier(Database::detail *imp) {
+  if (!imp->async) return;
+
+  std::string deferred;
+  bool fatal;
+  struct timeval start;
+  gettimeofday(&start, 0);
+  {
+    std::unique_lock<std::mutex> queue(imp->queue_lock);
+    imp->idle.wait(queue, [imp] { return imp->queue.empty() && !imp->busy; });
+    deferred.swap(imp->deferred);
+    fatal = imp->fatal;
+    imp->stall_seconds += elapsed(start);
+  }
+
+  if (!deferred.empty()) status_write(STREAM_ERROR, deferred);
+  if (fatal) exit(1);
+}
+
+// status_write is not thread-safe, so the writer thread leaves problems for barrier()
+static void report(Database::detail *imp, const std::string &message, bool fatal) {
+  if (imp->async) {
+    std::lock_guard<std::mutex> queue(imp->queue_lock);
+    imp->deferred.append(message);
+    imp->fatal = imp->fatal || fatal;
+  } else {
+    status_write(STREAM_ERROR, message);
+  }
+}
+
+static void stop_writer(Database::detail *imp) {
+  if (!imp->async) return;
+
+  barrier(imp);
+  {
+    std::lock_guard<std::mutex> queue(imp->queue_lock);
+    imp->quit = true;
+  }
+  imp->work.notify_one();
+  imp->writer.join();
+  imp->async = false;
+}
+
 void Database::entropy(uint64_t *key, int words) {
   const char *why = "Could not restore entropy";
   int word;
 
-  begin_txn();
+  txn_begin(imp.get());
 
   // Use entropy from DB
   for (word = 0; word < words; ++word) {
@@ -571,7 +1149,7 @@ void Database::entropy(uint64_t *key, int words) {
     single_step (why, imp->set_entropy, imp->debugdb);
   }
 
-  end_txn();
+  txn_end(imp.get());
 }
 
 void Database::prepare() {
@@ -583,140 +1161,392 @@ void Database::prepare() {
     exit(1);
   }
   imp->run_id = sqlite3_last_insert_rowid(imp->db);
+
+  // Job ids are handed out here, so insert_job need not wait for the writer
+  if (sqlite3_step(imp->next_job) == SQLITE_ROW)
+    imp->next_job_id = sqlite3_column_int64(imp->next_job, 0);
+  finish_stmt("Could not find the next job id", imp->next_job, imp->debugdb);
+
+  // Debug output is printed as statements run, so keep them on this thread
+  if (!imp->debugdb) {
+    imp->async = true;
+    imp->writer = std::thread(write_loop, imp.get());
+  }
 }
 
-void Database::clean() {
+struct CritJob {
+  long job, stat;
+  double runtime, pathtime;
+  std::vector<std::pair<long, double> > users; // job_id and stored pathtime of jobs reading our outputs
+};
+
+// The critical path of each job used by this run is its runtime plus the longest path of the jobs
+// which read its outputs. Jobs are created after the jobs whose outputs they read, so reverse job order is topological.
+static void critical_paths(Database::detail *imp) {
   const char *why = "Could not compute critical path";
-  begin_txn();
+  std::vector<CritJob> jobs;
+  std::unordered_map<long, size_t> index;
   while (sqlite3_step(imp->revtop_order) == SQLITE_ROW) {
-    bind_integer(why, imp->setcrit_path, 1, sqlite3_column_int64(imp->revtop_order, 0));
-    single_step(why, imp->setcrit_path, imp->debugdb);
+    index[sqlite3_column_int64(imp->revtop_order, 0)] = jobs.size();
+    jobs.emplace_back();
+    CritJob &j = jobs.back();
+    j.job      = sqlite3_column_int64 (imp->revtop_order, 0);
+    j.stat     = sqlite3_column_int64 (imp->revtop_order, 1);
+    j.runtime  = sqlite3_column_double(imp->revtop_order, 2);
+    j.pathtime = 0;
   }
   finish_stmt(why, imp->revtop_order, imp->debugdb);
-  end_txn();
+
+  while (sqlite3_step(imp->crit_edges) == SQLITE_ROW) {
+    auto it = index.find(sqlite3_column_int64(imp->crit_edges, 0));
+    if (it == index.end()) continue;
+    jobs[it->second].users.emplace_back(
+      sqlite3_column_int64 (imp->crit_edges, 1),
+      sqlite3_column_double(imp->crit_edges, 2));
+  }
+  finish_stmt(why, imp->crit_edges, imp->debugdb);
+
+  txn_begin(imp);
+  for (auto &j : jobs) {
+    double longest = 0;
+    for (auto &u : j.users) {
+      // A user not yet visited (or outside this run) keeps the pathtime it had
+      auto it = index.find(u.first);
+      double pathtime = (it != index.end() && u.first > j.job) ? jobs[it->second].pathtime : u.second;
+      longest = std::max(longest, pathtime);
+    }
+    j.pathtime = j.runtime + longest;
+    bind_double (why, imp->setcrit_path, 1, j.pathtime);
+    bind_integer(why, imp->setcrit_path, 2, j.stat);
+    single_step (why, imp->setcrit_path, imp->debugdb);
+  }
+  txn_end(imp);
+}
+
+void Database::clean() {
+  const char *why = "Could not compute critical path";
+  struct timeval start, stop;
+  gettimeofday(&start, 0);
+  stop_writer(imp.get());
+  critical_paths(imp.get());
 
   bind_integer(why, imp->delete_jobs, 1, imp->run_id);
   single_step("Could not clean database jobs",  imp->delete_jobs,  imp->debugdb);
   single_step("Could not clean database dups",  imp->delete_dups,  imp->debugdb);
   single_step("Could not clean database stats", imp->delete_stats, imp->debugdb);
+  single_step("Could not clean database blobs", imp->delete_blobs, imp->debugdb);
 
   // This cannot be a prepared statement, because pragmas may run on prepare
   char *fail;
   int ret = sqlite3_exec(imp->db, "pragma incremental_vacuum;", 0, 0, &fail);
   if (ret != SQLITE_OK)
     std::cerr << "Could not recover space: " << fail << std::endl;
+
+  gettimeofday(&stop, 0);
+  imp->clean_seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1000000.0;
 }
 
 void Database::begin_txn() {
-  single_step("Could not begin a transaction", imp->begin_txn, imp->debugdb);
+  Database::detail *d = imp.get();
+  submit(d, [d] { txn_begin(d); });
 }
 
 void Database::end_txn() {
-  single_step("Could not commit a transaction", imp->commit_txn, imp->debugdb);
+  Database::detail *d = imp.get();
+  submit(d, [d] { txn_end(d); });
 }
 
-// This function needs to be able to run twice in succession and return the same results
-// ... because heap allocations are created to hold the file list output by this function.
-// Fortunately, updating use_id is the only side-effect and it does not affect reuse_job.
-Usage Database::reuse_job(
-  const std::string &directory,
-  const std::string &environment,
-  const std::string &commandline,
-  const std::string &stdin_file,
-  uint64_t           signature,
-  const std::string &visible,
-  bool check,
-  long &job,
-  std::vector<FileReflection> &files,
-  double *pathtime)
-{
-  Usage out;
-  long stat_id;
+void Database::timings(double &writing, double &stalled, double &cleaning) {
+  std::lock_guard<std::mutex> queue(imp->queue_lock);
+  writing = imp->write_seconds;
+  stalled = imp->stall_seconds;
+  cleaning = imp->clean_seconds;
+}
 
-  // When implementing indexed directories, beware of non-existent BADPATH files
+void Database::sweep_spills(const std::string &dir) {
+  const char *why = "Could not list spilled job output";
+  // Spill files are named by their content, so compare names; the recorded dir may be spelled differently
+  std::set<std::string> keep;
+  barrier(imp.get());
+  {
+    std::lock_guard<std::mutex> hold(imp->db_lock);
+    while (sqlite3_step(imp->all_spills) == SQLITE_ROW) {
+      std::string path = rip_column(imp->all_spills, 0);
+      keep.insert(path.substr(path.find_last_of('/') + 1));
+    }
+    finish_stmt(why, imp->all_spills, imp->debugdb);
+  }
 
-  const char *why = "Could not check for a cached job";
-  begin_txn();
-  bind_string (why, imp->find_prior, 1, directory);
-  bind_blob   (why, imp->find_prior, 2, commandline);
-  bind_blob   (why, imp->find_prior, 3, environment);
-  bind_string (why, imp->find_prior, 4, stdin_file);
-  bind_integer(why, imp->find_prior, 5, signature);
-  out.found = sqlite3_step(imp->find_prior) == SQLITE_ROW;
-  if (out.found) {
-    job     = sqlite3_column_int64(imp->find_prior, 0);
-    stat_id = sqlite3_column_int64(imp->find_prior, 1);
-  }
-  finish_stmt (why, imp->find_prior, imp->debugdb);
-
-  if (!out.found) {
-    end_txn();
-    return out;
+  std::set<std::string> dirs(imp->spill_dirs);
+  dirs.insert(dir);
+  for (auto &d : dirs) {
+    DIR *spills = opendir(d.c_str());
+    if (!spills) continue;
+    while (struct dirent *f = readdir(spills)) {
+      if (f->d_name[0] == '.') continue;
+      if (keep.find(f->d_name) != keep.end()) continue;
+      std::string path = d + "/" + f->d_name;
+      unlink(path.c_str());
+    }
+    closedir(spills);
   }
+}
 
-  bind_integer(why, imp->stats_job, 1, stat_id);
-  if (sqlite3_step(imp->stats_job) == SQLITE_ROW) {
-    out.status   = sqlite3_column_int64 (imp->stats_job, 0);
-    out.runtime  = sqlite3_column_double(imp->stats_job, 1);
-    out.cputime  = sqlite3_column_double(imp->stats_job, 2);
-    out.membytes = sqlite3_column_int64 (imp->stats_job, 3);
-    out.ibytes   = sqlite3_column_int64 (imp->stats_job, 4);
-    out.obytes   = sqlite3_column_int64 (imp->stats_job, 5);
-    *pathtime    = sqlite3_column_double(imp->stats_job, 6);
-  } else {
-    out.found = false;
+// The blob_id of a commandline or environment, stored once however many jobs share it.
+// Commandlines are kept raw, so that queries can still recognize those of internal jobs.
+static long intern_blob(Database::detail *imp, const std::string &raw, bool packed) {
+  const char *why = "Could not intern a job blob";
+  long hash = Hash(raw).data[0];
+  std::string content = packed ? pack(raw) : raw;
+  long id;
+  bind_integer(why, imp->find_blob, 1, hash);
+  bind_blob   (why, imp->find_blob, 2, content);
+  bool found = sqlite3_step(imp->find_blob) == SQLITE_ROW;
+  if (found) id = sqlite3_column_int64(imp->find_blob, 0);
+  finish_stmt(why, imp->find_blob, imp->debugdb);
+  if (found) return id;
+
+  bind_integer(why, imp->insert_blob, 1, hash);
+  bind_blob   (why, imp->insert_blob, 2, content);
+  single_step (why, imp->insert_blob, imp->debugdb);
+  return sqlite3_last_insert_rowid(imp->db);
+}
+
+// The file_id of a path which has been hashed
+static long find_file(Database::detail *imp, const char *why, const char *path, size_t len) {
+  std::string key(path, len);
+  auto it = imp->file_ids.find(key);
+  if (it != imp->file_ids.end()) return it->second;
+
+  bind_string(why, imp->find_file, 1, key);
+  bool found = sqlite3_step(imp->find_file) == SQLITE_ROW;
+  long id = found ? sqlite3_column_int64(imp->find_file, 0) : 0;
+  finish_stmt(why, imp->find_file, imp->debugdb);
+  if (!found) {
+    std::cerr << why << "; no hash was recorded for '" << key << "'" << std::endl;
+    exit(1);
   }
-  finish_stmt(why, imp->stats_job, imp->debugdb);
 
-  // Create a hash table of visible files
-  std::unordered_set<std::string> vis;
-  const char *tok = visible.c_str();
-  const char *end = tok + visible.size();
+  imp->file_ids.emplace(std::move(key), id);
+  return id;
+}
+
+// Record one access of a job to many files, TREE_BATCH rows at a time
+static void insert_tree(Database::detail *imp, const char *why, int access, long job, const std::vector<long> &files) {
+  size_t i = 0;
+  for (; i + TREE_BATCH <= files.size(); i += TREE_BATCH) {
+    bind_integer(why, imp->insert_trees, 1, access);
+    bind_integer(why, imp->insert_trees, 2, job);
+    for (int j = 0; j < TREE_BATCH; ++j)
+      bind_integer(why, imp->insert_trees, j+3, files[i+j]);
+    single_step(why, imp->insert_trees, imp->debugdb);
+  }
+  for (; i < files.size(); ++i) {
+    bind_integer(why, imp->insert_tree, 1, access);
+    bind_integer(why, imp->insert_tree, 2, job);
+    bind_integer(why, imp->insert_tree, 3, files[i]);
+    single_step (why, imp->insert_tree, imp->debugdb);
+  }
+}
+
+// Tokens of a null separated list
+static void split_nulls(const char *tok, size_t size, std::unordered_set<std::string> &out) {
+  const char *end = tok + size;
   for (const char *scan = tok; scan != end; ++scan) {
     if (*scan == 0 && scan != tok) {
-      vis.emplace(tok, scan-tok);
+      out.emplace(tok, scan-tok);
       tok = scan+1;
     }
   }
+}
 
-  // Confirm all inputs are still visible
-  bind_integer(why, imp->get_tree, 1, job);
-  bind_integer(why, imp->get_tree, 2, INPUT);
-  while (sqlite3_step(imp->get_tree) == SQLITE_ROW) {
-    if (vis.find(rip_column(imp->get_tree, 0)) == vis.end()) out.found = false;
+// Check a share of the current batch; called by the main thread and the pool
+static void check_some(Database::detail *imp) {
+  const std::vector<const std::string *> &paths = *imp->check_paths;
+  std::vector<char> &ok = *imp->check_ok;
+  size_t first;
+  while ((first = imp->check_next.fetch_add(PROBE_CHUNK)) < paths.size()) {
+    size_t end = std::min(first + PROBE_CHUNK, paths.size());
+    for (size_t i = first; i < end; ++i)
+      ok[i] = access(paths[i]->c_str(), R_OK) == 0;
   }
-  finish_stmt(why, imp->get_tree, imp->debugdb);
+}
 
-  // Confirm all outputs still exist, and report their old hashes
-  bind_integer(why, imp->get_tree, 1, job);
-  bind_integer(why, imp->get_tree, 2, OUTPUT);
-  while (sqlite3_step(imp->get_tree) == SQLITE_ROW) {
-    std::string path = rip_column(imp->get_tree, 0);
-    if (access(path.c_str(), R_OK) != 0) out.found = false;
-    files.emplace_back(std::move(path), rip_column(imp->get_tree, 1));
+static void check_loop(Database::detail *imp) {
+  size_t seen = 0;
+  std::unique_lock<std::mutex> lock(imp->check_lock);
+  while (true) {
+    imp->check_work.wait(lock, [imp, seen] { return imp->check_quit || imp->check_round != seen; });
+    if (imp->check_quit) return;
+    seen = imp->check_round;
+    lock.unlock();
+    check_some(imp);
+    lock.lock();
+    if (--imp->check_busy == 0) imp->check_done.notify_one();
   }
-  finish_stmt(why, imp->get_tree, imp->debugdb);
+}
 
-  // If we need to rerun the job (outputs don't exist), wipe the files-to-check list
-  if (!out.found) {
-    files.clear();
+static void stop_checkers(Database::detail *imp) {
+  if (imp->checkers.empty()) return;
+  {
+    std::lock_guard<std::mutex> lock(imp->check_lock);
+    imp->check_quit = true;
   }
+  imp->check_work.notify_all();
+  for (auto &thread : imp->checkers) thread.join();
+  imp->checkers.clear();
+}
 
-  if (out.found && !check) {
-    bind_integer(why, imp->update_prior, 1, imp->run_id);
-    bind_integer(why, imp->update_prior, 2, job);
-    single_step (why, imp->update_prior, imp->debugdb);
+// Check that outputs still exist, consulting each path only once per run
+static void check_outputs(Database::detail *imp, const std::vector<const std::string *> &paths, std::vector<char> &ok) {
+  std::vector<const std::string *> cold;
+  for (auto path : paths)
+    if (imp->present.emplace(*path, false).second)
+      cold.push_back(path);
+
+  std::vector<char> found(cold.size());
+  imp->check_paths = &cold;
+  imp->check_ok = &found;
+  imp->check_next = 0;
+
+  size_t threads = std::min<size_t>(PROBE_THREADS, cold.size() / PROBE_PER_THREAD);
+  if (threads > 1) {
+    while (imp->checkers.size() < PROBE_THREADS-1)
+      imp->checkers.emplace_back(check_loop, imp);
+    {
+      std::lock_guard<std::mutex> lock(imp->check_lock);
+      imp->check_busy = imp->checkers.size();
+      ++imp->check_round;
+    }
+    imp->check_work.notify_all();
+    check_some(imp);
+    std::unique_lock<std::mutex> lock(imp->check_lock);
+    imp->check_done.wait(lock, [imp] { return imp->check_busy == 0; });
+  } else {
+    check_some(imp);
   }
 
-  end_txn();
+  for (size_t i = 0; i < cold.size(); ++i)
+    imp->present[*cold[i]] = found[i];
 
-  return out;
+  ok.resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    ok[i] = imp->present[*paths[i]];
+}
+
+// Wake changed this path (or the tree under it); check it again if asked
+static void forget_present(Database::detail *imp, const std::string &path) {
+  auto it = imp->present.lower_bound(path);
+  while (it != imp->present.end() && it->first.compare(0, path.size(), path) == 0) {
+    if (it->first.size() == path.size() || it->first[path.size()] == '/') {
+      it = imp->present.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// Each probe's visible list must not move until this returns
+void Database::reuse_jobs(std::vector<CacheProbe> &probes, bool check)
+{
+  // When implementing indexed directories, beware of non-existent BADPATH files
+
+  const char *why = "Could not check for a cached job";
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
+  txn_begin(imp.get());
+
+  single_step(why, imp->clear_probes, imp->debugdb);
+  for (size_t i = 0; i < probes.size(); ++i) {
+    CacheProbe &probe = probes[i];
+    probe.usage.found = false;
+    probe.files.clear();
+    std::string identity = job_identity(probe.directory, probe.commandline, probe.environment, probe.stdin_file);
+    bind_integer(why, imp->insert_probe, 1, i);
+    bind_blob   (why, imp->insert_probe, 2, identity);
+    bind_integer(why, imp->insert_probe, 3, probe.signature);
+    single_step (why, imp->insert_probe, imp->debugdb);
+  }
+
+  // One row per input or output of each prior job, ordered by probe
+  std::vector<bool> hidden(probes.size(), false); // an input is no longer visible
+  std::unordered_set<std::string> vis;
+  size_t vis_of = probes.size();
+  while (sqlite3_step(imp->find_priors) == SQLITE_ROW) {
+    size_t i = sqlite3_column_int64(imp->find_priors, 0);
+    CacheProbe &probe = probes[i];
+    Usage &out = probe.usage;
+    long job = sqlite3_column_int64(imp->find_priors, 1);
+    if (!out.found) {
+      out.found      = true;
+      probe.job      = job;
+      out.status     = sqlite3_column_int64 (imp->find_priors, 2);
+      out.runtime    = sqlite3_column_double(imp->find_priors, 3);
+      out.cputime    = sqlite3_column_double(imp->find_priors, 4);
+      out.membytes   = sqlite3_column_int64 (imp->find_priors, 5);
+      out.ibytes     = sqlite3_column_int64 (imp->find_priors, 6);
+      out.obytes     = sqlite3_column_int64 (imp->find_priors, 7);
+      probe.pathtime = sqlite3_column_double(imp->find_priors, 8);
+    } else if (probe.job != job) {
+      continue; // only the first matching job is considered
+    }
+    if (sqlite3_column_type(imp->find_priors, 9) == SQLITE_NULL) continue; // no files
+
+    // Confirm all inputs are still visible, and collect the outputs with their old hashes
+    if (sqlite3_column_int(imp->find_priors, 9) == INPUT) {
+      if (vis_of != i) {
+        vis.clear();
+        split_nulls(probe.visible, probe.visible_size, vis);
+        vis_of = i;
+      }
+      if (vis.find(rip_column(imp->find_priors, 10)) == vis.end()) hidden[i] = true;
+    } else {
+      probe.files.emplace_back(rip_column(imp->find_priors, 10), rip_column(imp->find_priors, 11));
+    }
+  }
+  finish_stmt(why, imp->find_priors, imp->debugdb);
+
+  std::vector<const std::string *> paths;
+  std::vector<size_t> owner;
+  for (size_t i = 0; i < probes.size(); ++i) {
+    CacheProbe &probe = probes[i];
+    if (hidden[i]) probe.usage.found = false;
+    if (!probe.usage.found) {
+      probe.files.clear();
+      continue;
+    }
+    for (auto &file : probe.files) {
+      paths.push_back(&file.path);
+      owner.push_back(i);
+    }
+  }
+
+  // Confirm all outputs still exist
+  std::vector<char> ok;
+  check_outputs(imp.get(), paths, ok);
+  for (size_t i = 0; i < paths.size(); ++i)
+    if (!ok[i]) probes[owner[i]].usage.found = false;
+
+  for (auto &probe : probes) {
+    // If we need to rerun the job (outputs don't exist), wipe the files-to-check list
+    if (!probe.usage.found) {
+      probe.files.clear();
+    } else if (!check) {
+      bind_integer(why, imp->update_prior, 1, imp->run_id);
+      bind_integer(why, imp->update_prior, 2, probe.job);
+      single_step (why, imp->update_prior, imp->debugdb);
+    }
+  }
+
+  txn_end(imp.get());
 }
 
 Usage Database::predict_job(uint64_t hashcode, double *pathtime)
 {
   Usage out;
   const char *why = "Could not predict a job";
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   bind_integer(why, imp->predict_job, 1, hashcode);
   if (sqlite3_step(imp->predict_job) == SQLITE_ROW) {
     out.found    = true;
@@ -741,7 +1571,9 @@ Usage Database::predict_job(uint64_t hashcode, double *pathtime)
   return out;
 }
 
-void Database::insert_job(
+static void insert_job(
+  Database::detail *imp,
+  long job,
   const std::string &directory,
   const std::string &commandline,
   const std::string &environment,
@@ -749,38 +1581,59 @@ void Database::insert_job(
   uint64_t          signature,
   const std::string &label,
   const std::string &stack,
-  const std::string &visible,
-  long  *job)
+  const std::string &visible)
 {
   const char *why = "Could not insert a job";
-  begin_txn();
-  bind_integer(why, imp->insert_job, 1, imp->run_id);
-  bind_string (why, imp->insert_job, 2, label);
-  bind_string (why, imp->insert_job, 3, directory);
-  bind_blob   (why, imp->insert_job, 4, commandline);
-  bind_blob   (why, imp->insert_job, 5, environment);
-  bind_string (why, imp->insert_job, 6, stdin_file);
-  bind_integer(why, imp->insert_job, 7, signature);
-  bind_blob   (why, imp->insert_job, 8, stack);
+  txn_begin(imp);
+  std::string identity = job_identity(directory, commandline, environment, stdin_file);
+  long cmd = intern_blob(imp, commandline, false);
+  long env = intern_blob(imp, environment, true);
+  std::string packed_stack = pack(stack);
+  bind_integer(why, imp->insert_job, 1, job);
+  bind_integer(why, imp->insert_job, 2, imp->run_id);
+  bind_string (why, imp->insert_job, 3, label);
+  bind_string (why, imp->insert_job, 4, directory);
+  bind_integer(why, imp->insert_job, 5, cmd);
+  bind_integer(why, imp->insert_job, 6, env);
+  bind_string (why, imp->insert_job, 7, stdin_file);
+  bind_integer(why, imp->insert_job, 8, signature);
+  bind_blob   (why, imp->insert_job, 9, packed_stack);
+  bind_blob   (why, imp->insert_job, 10, identity);
   single_step (why, imp->insert_job, imp->debugdb);
-  *job = sqlite3_last_insert_rowid(imp->db);
+  std::vector<long> files;
   const char *tok = visible.c_str();
   const char *end = tok + visible.size();
   for (const char *scan = tok; scan != end; ++scan) {
     if (*scan == 0 && scan != tok) {
-      bind_integer(why, imp->insert_tree, 1, VISIBLE);
-      bind_integer(why, imp->insert_tree, 2, *job);
-      bind_string (why, imp->insert_tree, 3, tok, scan-tok);
-      single_step (why, imp->insert_tree, imp->debugdb);
+      files.push_back(find_file(imp, why, tok, scan-tok));
       tok = scan+1;
     }
   }
-  end_txn();
+  insert_tree(imp, why, VISIBLE, job, files);
+  txn_end(imp);
 }
 
-void Database::finish_job(long job, const std::string &inputs, const std::string &outputs, uint64_t hashcode, bool keep, Usage reality) {
+void Database::insert_job(
+  const std::string &directory,
+  const std::string &commandline,
+  const std::string &environment,
+  const std::string &stdin_file,
+  uint64_t          signature,
+  const std::string &label,
+  const std::string &stack,
+  const std::string &visible,
+  long  *job)
+{
+  Database::detail *d = imp.get();
+  long id = *job = ++imp->next_job_id;
+  submit(d, [=] {
+    ::insert_job(d, id, directory, commandline, environment, stdin_file, signature, label, stack, visible);
+  });
+}
+
+static void finish_job(Database::detail *imp, long job, const std::string &inputs, const std::string &outputs, uint64_t hashcode, bool keep, Usage reality) {
   const char *why = "Could not save job inputs and outputs";
-  begin_txn();
+  txn_begin(imp);
   bind_integer(why, imp->add_stats, 1, hashcode);
   bind_integer(why, imp->add_stats, 2, reality.status);
   bind_double (why, imp->add_stats, 3, reality.runtime);
@@ -801,6 +1654,7 @@ void Database::finish_job(long job, const std::string &inputs, const std::string
     visible.insert(rip_column(imp->get_tree, 0));
   finish_stmt(why, imp->get_tree, imp->debugdb);
   // Insert inputs, confirming they are visible
+  std::vector<long> files;
   const char *tok = inputs.c_str();
   const char *end = tok + inputs.size();
   for (const char *scan = tok; scan != end; ++scan) {
@@ -811,28 +1665,25 @@ void Database::finish_job(long job, const std::string &inputs, const std::string
         s << "Job " << job
           << " erroneously added input '" << input
           << "' which was not a visible file." << std::endl;
-        status_write(STREAM_ERROR, s.str());
+        report(imp, s.str(), false);
       } else {
-        bind_integer(why, imp->insert_tree, 1, INPUT);
-        bind_integer(why, imp->insert_tree, 2, job);
-        bind_string (why, imp->insert_tree, 3, tok, scan-tok);
-        single_step (why, imp->insert_tree, imp->debugdb);
+        files.push_back(find_file(imp, why, tok, scan-tok));
       }
       tok = scan+1;
     }
   }
+  insert_tree(imp, why, INPUT, job, files);
   // Insert outputs
+  files.clear();
   tok = outputs.c_str();
   end = tok + outputs.size();
   for (const char *scan = tok; scan != end; ++scan) {
     if (*scan == 0 && scan != tok) {
-      bind_integer(why, imp->insert_tree, 1, OUTPUT);
-      bind_integer(why, imp->insert_tree, 2, job);
-      bind_string (why, imp->insert_tree, 3, tok, scan-tok);
-      single_step (why, imp->insert_tree, imp->debugdb);
+      files.push_back(find_file(imp, why, tok, scan-tok));
       tok = scan+1;
     }
   }
+  insert_tree(imp, why, OUTPUT, job, files);
 
   bind_integer(why, imp->delete_prior, 1, imp->run_id);
   bind_integer(why, imp->delete_prior, 2, job);
@@ -847,27 +1698,44 @@ void Database::finish_job(long job, const std::string &inputs, const std::string
   while (sqlite3_step(imp->detect_overlap) == SQLITE_ROW) {
     std::stringstream s;
     s << "File output by multiple Jobs: " << rip_column(imp->detect_overlap, 0) << std::endl;
-    status_write(STREAM_ERROR, s.str());
+    report(imp, s.str(), true);
     fail = true;
   }
   finish_stmt(why, imp->detect_overlap, imp->debugdb);
 
-  end_txn();
+  txn_end(imp);
+
+  if (fail && !imp->async) exit(1);
+}
+
+void Database::finish_job(long job, const std::string &inputs, const std::string &outputs, uint64_t hashcode, bool keep, Usage reality) {
+  Database::detail *d = imp.get();
+  std::unordered_set<std::string> written;
+  split_nulls(outputs.c_str(), outputs.size(), written);
+  for (auto &path : written) forget_present(d, path);
+  submit(d, [=] { ::finish_job(d, job, inputs, outputs, hashcode, keep, reality); });
+}
 
-  if (fail) exit(1);
+void Database::forget_path(const std::string &path) {
+  forget_present(imp.get(), path);
 }
 
 void Database::tag_job(long job, const std::string &uri, const std::string &content) {
-  const char *why = "Could not tag a job";
-  bind_integer(why, imp->tag_job, 1, job);
-  bind_string (why, imp->tag_job, 2, uri);
-  bind_string (why, imp->tag_job, 3, content);
-  single_step (why, imp->tag_job, imp->debugdb);
+  Database::detail *d = imp.get();
+  submit(d, [=] {
+    const char *why = "Could not tag a job";
+    bind_integer(why, d->tag_job, 1, job);
+    bind_string (why, d->tag_job, 2, uri);
+    bind_string (why, d->tag_job, 3, content);
+    single_step (why, d->tag_job, d->debugdb);
+  });
 }
 
 std::vector<FileReflection> Database::get_tree(int kind, long job)  {
   std::vector<FileReflection> out;
   const char *why = "Could not read job tree";
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   bind_integer(why, imp->get_tree, 1, job);
   bind_integer(why, imp->get_tree, 2, kind);
   while (sqlite3_step(imp->get_tree) == SQLITE_ROW)
@@ -877,49 +1745,114 @@ std::vector<FileReflection> Database::get_tree(int kind, long job)  {
 }
 
 void Database::save_output(long job, int descriptor, const char *buffer, int size, double runtime) {
-  const char *why = "Could not save job output";
-  bind_integer(why, imp->insert_log, 1, job);
-  bind_integer(why, imp->insert_log, 2, descriptor);
-  bind_double (why, imp->insert_log, 3, runtime);
-  bind_string (why, imp->insert_log, 4, buffer, size);
-  single_step (why, imp->insert_log, imp->debugdb);
+  Database::detail *d = imp.get();
+  std::string output(buffer, size);
+  submit(d, [=] {
+    const char *why = "Could not save job output";
+    std::string packed = pack(output);
+    bind_integer(why, d->insert_log, 1, job);
+    bind_integer(why, d->insert_log, 2, descriptor);
+    bind_double (why, d->insert_log, 3, runtime);
+    bind_blob   (why, d->insert_log, 4, packed);
+    single_step (why, d->insert_log, d->debugdb);
+  });
 }
 
-std::string Database::get_output(long job, int descriptor) {
-  std::stringstream out;
+void Database::save_spill(long job, int descriptor, const std::string &path, uint64_t bytes, const std::string &tail) {
+  Database::detail *d = imp.get();
+  submit(d, [=] {
+    const char *why = "Could not save spilled job output";
+    bind_integer(why, d->insert_spill, 1, job);
+    bind_integer(why, d->insert_spill, 2, descriptor);
+    bind_string (why, d->insert_spill, 3, path);
+    bind_integer(why, d->insert_spill, 4, bytes);
+    bind_string (why, d->insert_spill, 5, tail);
+    single_step (why, d->insert_spill, d->debugdb);
+  });
+}
+
+// Pass any output which follows the log, mapped from its spill file, to 'out'.
+// If that file is gone, only the tail saved in the database can be recovered.
+static void read_spill(Database::detail *imp, long job, int descriptor, const std::function<void(const char *, size_t)> &out) {
+  const char *why = "Could not read spilled job output";
+  bind_integer(why, imp->get_spill, 1, job);
+  bind_integer(why, imp->get_spill, 2, descriptor);
+  if (sqlite3_step(imp->get_spill) == SQLITE_ROW) {
+    std::string path = rip_column(imp->get_spill, 0);
+    size_t bytes = sqlite3_column_int64(imp->get_spill, 1);
+    std::string tail = rip_column(imp->get_spill, 2);
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size == bytes && bytes > 0)
+      map = mmap(0, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd != -1) close(fd);
+
+    if (map != MAP_FAILED) {
+      out(static_cast<const char*>(map), bytes);
+      munmap(map, bytes);
+    } else if (bytes > 0) {
+      std::stringstream note;
+      note << std::endl << "[wake: " << bytes << " bytes of output were spilled to " << path
+        << ", which is gone; the last " << tail.size() << " follow]" << std::endl;
+      std::string str = note.str();
+      out(str.data(), str.size());
+      out(tail.data(), tail.size());
+    }
+  }
+  finish_stmt(why, imp->get_spill, imp->debugdb);
+}
+
+static std::string get_output(Database::detail *imp, long job, int descriptor) {
+  std::string out;
   const char *why = "Could not read job output";
   bind_integer(why, imp->get_log, 1, job);
   bind_integer(why, imp->get_log, 2, descriptor);
-  while (sqlite3_step(imp->get_log) == SQLITE_ROW) {
-    out.write(
-      static_cast<const char*>(sqlite3_column_blob(imp->get_log, 0)),
-      sqlite3_column_bytes(imp->get_log, 0));
-  }
+  while (sqlite3_step(imp->get_log) == SQLITE_ROW)
+    out.append(unpack_column(imp->get_log, 0));
   finish_stmt(why, imp->get_log, imp->debugdb);
-  return out.str();
+  read_spill(imp, job, descriptor, [&out](const char *data, size_t len) { out.append(data, len); });
+  return out;
+}
+
+std::string Database::get_output(long job, int descriptor) {
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
+  return ::get_output(imp.get(), job, descriptor);
 }
 
 void Database::replay_output(long job, const char *stdout, const char *stderr) {
   const char *why = "Could not replay job output";
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   bind_integer(why, imp->replay_log, 1, job);
   bool needlf[2] = { false, false };
   while (sqlite3_step(imp->replay_log) == SQLITE_ROW) {
     int fd = sqlite3_column_int64(imp->replay_log, 0);
-    const char *str = static_cast<const char*>(sqlite3_column_blob(imp->replay_log, 1));
-    int len = sqlite3_column_bytes(imp->replay_log, 1);
+    std::string output = unpack_column(imp->replay_log, 1);
+    const char *str = output.data();
+    int len = output.size();
     if (len > 0) {
       status_write(fd==2?stderr:stdout, str, len);
       needlf[fd-1] = str[len-1] != '\n';
     }
   }
   finish_stmt(why, imp->replay_log, imp->debugdb);
+  for (int fd = 1; fd <= 2; ++fd) {
+    read_spill(imp.get(), job, fd, [&](const char *data, size_t len) {
+      for (size_t done = 0; done < len; done += SPILL_REPLAY_CHUNK)
+        status_write(fd==2?stderr:stdout, data + done, std::min(len - done, (size_t)SPILL_REPLAY_CHUNK));
+      if (len > 0) needlf[fd-1] = data[len-1] != '\n';
+    });
+  }
   if (needlf[0]) status_write(stdout, "\n", 1);
   if (needlf[1]) status_write(stderr, "\n", 1);
 }
 
-void Database::add_hash(const std::string &file, const std::string &hash, long modified) {
+static void add_hash(Database::detail *imp, const std::string &file, const std::string &hash, long modified) {
   const char *why = "Could not insert a hash";
-  begin_txn();
+  txn_begin(imp);
   bind_string (why, imp->wipe_file, 1, file);
   bind_string (why, imp->wipe_file, 2, hash);
   single_step (why, imp->wipe_file, imp->debugdb);
@@ -931,12 +1864,20 @@ void Database::add_hash(const std::string &file, const std::string &hash, long m
   bind_integer(why, imp->insert_file, 2, modified);
   bind_string (why, imp->insert_file, 3, file);
   single_step (why, imp->insert_file, imp->debugdb);
-  end_txn();
+  if (sqlite3_changes(imp->db) > 0)
+    imp->file_ids[file] = sqlite3_last_insert_rowid(imp->db);
+  txn_end(imp);
 }
 
+void Database::add_hash(const std::string &file, const std::string &hash, long modified) {
+  Database::detail *d = imp.get();
+  submit(d, [=] { ::add_hash(d, file, hash, modified); });
+}
 std::string Database::get_hash(const std::string &file, long modified) {
   std::string out;
   const char *why = "Could not fetch a hash";
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   bind_string (why, imp->fetch_hash, 1, file);
   bind_integer(why, imp->fetch_hash, 2, modified);
   if (sqlite3_step(imp->fetch_hash) == SQLITE_ROW)
@@ -966,8 +1907,8 @@ static JobReflection find_one(Database *db, sqlite3_stmt *query, bool verbose) {
   desc.label          = rip_column(query, 1);
   desc.directory      = rip_column(query, 2);
   desc.commandline    = chop_null(rip_column(query, 3));
-  desc.environment    = chop_null(rip_column(query, 4));
-  desc.stack          = rip_column(query, 5);
+  desc.environment    = chop_null(unpack_column(query, 4));
+  desc.stack          = unpack_column(query, 5);
   desc.stdin_file     = rip_column(query, 6);
   desc.time           = rip_column(query, 7);
   desc.usage.status   = sqlite3_column_int64 (query, 8);
@@ -978,8 +1919,8 @@ static JobReflection find_one(Database *db, sqlite3_stmt *query, bool verbose) {
   desc.usage.obytes   = sqlite3_column_int64 (query, 13);
   if (desc.stdin_file.empty()) desc.stdin_file = "/dev/null";
   if (verbose) {
-    desc.stdout_payload = db->get_output(desc.job, 1);
-    desc.stderr_payload = db->get_output(desc.job, 2);
+    desc.stdout_payload = get_output(db->imp.get(), desc.job, 1);
+    desc.stderr_payload = get_output(db->imp.get(), desc.job, 2);
     // visible
     bind_integer(why, db->imp->get_tree, 1, desc.job);
     bind_integer(why, db->imp->get_tree, 2, VISIBLE);
@@ -1020,25 +1961,31 @@ static std::vector<JobReflection> find_all(Database *db, sqlite3_stmt *query, bo
   const char *why = "Could not explain file";
   std::vector<JobReflection> out;
 
-  db->begin_txn();
+  txn_begin(db->imp.get());
   while (sqlite3_step(query) == SQLITE_ROW)
     out.emplace_back(find_one(db, query, verbose));
   finish_stmt(why, query, db->imp->debugdb);
-  db->end_txn();
+  txn_end(db->imp.get());
 
   return out;
 }
 
 std::vector<JobReflection> Database::failed(bool verbose) {
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   return find_all(this, imp->find_failed, verbose);
 }
 
 std::vector<JobReflection> Database::last(bool verbose) {
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   return find_all(this, imp->find_last, verbose);
 }
 
 std::vector<JobReflection> Database::explain(long job, bool verbose) {
   const char *why = "Could not bind args";
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   bind_integer(why, imp->find_job, 1, job);
   return find_all(this, imp->find_job, verbose);
 }
@@ -1046,6 +1993,8 @@ std::vector<JobReflection> Database::explain(long job, bool verbose) {
 
 std::vector<JobReflection> Database::explain(const std::string &file, int use, bool verbose) {
   const char *why = "Could not bind args";
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   bind_string (why, imp->find_owner, 1, file);
   bind_integer(why, imp->find_owner, 2, use);
   return find_all(this, imp->find_owner, verbose);
@@ -1053,6 +2002,8 @@ std::vector<JobReflection> Database::explain(const std::string &file, int use, b
 
 std::vector<JobEdge> Database::get_edges() {
   std::vector<JobEdge> out;
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   while (sqlite3_step(imp->get_edges) == SQLITE_ROW) {
     out.emplace_back(
       sqlite3_column_int64(imp->get_edges, 0),
@@ -1062,8 +2013,40 @@ std::vector<JobEdge> Database::get_edges() {
   return out;
 }
 
+std::vector<PriorJob> Database::prior_jobs() {
+  std::vector<PriorJob> out;
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
+  while (sqlite3_step(imp->prior_jobs) == SQLITE_ROW) {
+    out.emplace_back();
+    PriorJob &prior = out.back();
+    prior.job         = sqlite3_column_int64(imp->prior_jobs, 0);
+    prior.label       = rip_column(imp->prior_jobs, 1);
+    prior.directory   = rip_column(imp->prior_jobs, 2);
+    prior.commandline = rip_column(imp->prior_jobs, 3);
+    prior.environment = unpack_column(imp->prior_jobs, 4);
+    prior.stdin_file  = rip_column(imp->prior_jobs, 5);
+    prior.signature   = sqlite3_column_int64(imp->prior_jobs, 6);
+    prior.stack       = unpack_column(imp->prior_jobs, 7);
+    prior.pathtime    = sqlite3_column_double(imp->prior_jobs, 8);
+  }
+  finish_stmt("Could not retrieve prior jobs", imp->prior_jobs, imp->debugdb);
+  return out;
+}
+
+void Database::forget_job(long job) {
+  Database::detail *d = imp.get();
+  submit(d, [=] {
+    const char *why = "Could not forget a job";
+    bind_integer(why, d->forget_job, 1, job);
+    single_step (why, d->forget_job, d->debugdb);
+  });
+}
+
 std::vector<JobTag> Database::get_tags() {
   std::vector<JobTag> out;
+  barrier(imp.get());
+  std::lock_guard<std::mutex> hold(imp->db_lock);
   while (sqlite3_step(imp->get_all_tags) == SQLITE_ROW) {
     out.emplace_back(
       sqlite3_column_int64(imp->get_all_tags, 0),
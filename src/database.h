@@ -40,6 +40,22 @@ struct Usage {
   Usage() : found(false) { }
 };
 
+// A job whose cached result is wanted (see reuse_jobs)
+struct CacheProbe {
+  std::string directory;
+  std::string environment;
+  std::string commandline;
+  std::string stdin_file; // "" -> /dev/null
+  uint64_t    signature;
+  const char *visible;    // null separated; must not move before reuse_jobs returns
+  size_t      visible_size;
+  // Filled in by reuse_jobs:
+  Usage usage;            // found -> the job can be reused
+  long job;
+  double pathtime;
+  std::vector<FileReflection> files; // outputs with their old hashes
+};
+
 struct JobTag {
   long job;
   std::string uri;
@@ -73,6 +89,19 @@ struct JobEdge {
   JobEdge(long user_, long used_) : user(user_), used(used_) { }
 };
 
+// A job which finished successfully in the last run (see --speculate)
+struct PriorJob {
+  long job;
+  std::string label;
+  std::string directory;
+  std::string commandline; // null separated
+  std::string environment; // null separated
+  std::string stdin_file;
+  std::string stack;
+  uint64_t signature;
+  double pathtime;
+};
+
 struct Database {
   struct detail;
   std::unique_ptr<detail> imp;
@@ -80,28 +109,27 @@ struct Database {
   Database(bool debugdb);
   ~Database();
 
-  std::string open(bool wait, bool memory);
+  // A readonly database may be queried while a build is using it
+  std::string open(bool wait, bool memory, bool readonly);
   void close();
 
   void entropy(uint64_t *key, int words);
 
+  // Between prepare and clean, writes are queued to a background thread.
+  // Reads which depend on earlier writes wait for the queue to drain.
   void prepare(); // prepare for job execution
   void clean(); // finished execution; sweep stale jobs
 
   void begin_txn();
   void end_txn();
 
-  Usage reuse_job(
-    const std::string &directory,
-    const std::string &environment,
-    const std::string &commandline,
-    const std::string &stdin_file, // "" -> /dev/null
-    uint64_t          signature,
-    const std::string &visible,
-    bool check,
-    long &job,
-    std::vector<FileReflection> &out,
-    double *pathtime);
+  // Seconds spent applying writes, waiting for queued writes to land, and in clean()
+  void timings(double &writing, double &stalled, double &cleaning);
+
+  // Find the cached results of many jobs at once
+  void reuse_jobs(
+    std::vector<CacheProbe> &probes,
+    bool check);
   Usage predict_job(
     uint64_t hashcode,
     double *pathtime);
@@ -124,6 +152,7 @@ struct Database {
     bool keep,
     Usage reality);
   std::vector<FileReflection> get_tree(int kind, long job);
+  void forget_path(const std::string &path); // wake changed it outside of a job
 
   void tag_job(
     long job,
@@ -136,6 +165,12 @@ struct Database {
     const char *buffer,
     int size,
     double runtime);
+  void save_spill( // output after the log, kept in a file (see --spill)
+    long job,
+    int descriptor,
+    const std::string &path,
+    uint64_t bytes,
+    const std::string &tail);
   std::string get_output(
     long job,
     int descriptor);
@@ -169,6 +204,15 @@ struct Database {
     bool verbose);
 
   std::vector<JobEdge> get_edges();
+
+  // Jobs kept by the last run which exited 0, longest critical path first
+  std::vector<PriorJob> prior_jobs();
+  // Remove a job which was inserted, but will never be finished
+  void forget_job(long job);
+
+  // Remove files which no remaining job's output was spilled to, from dir and
+  // every dir which held spilled output when the database was opened
+  void sweep_spills(const std::string &dir);
   std::vector<JobTag> get_tags();
 };
 
@@ -33,9 +33,15 @@
 #include <limits.h>
 
 #include <sstream>
+#include <iomanip>
 #include <iostream>
 #include <list>
+#include <deque>
+#include <map>
+#include <set>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <cstring>
 #include <algorithm>
 #include <limits>
@@ -55,6 +61,16 @@
 #include "physmem.h"
 #include "sigwinch.h"
 #include "spawn.h"
+#include "poll.h"
+#include "sysload.h"
+#include "profile.h"
+#include "cgroup.h"
+#include "launcher.h"
+#include "mkdir_parents.h"
+#include "hash.h"
+#include "speculate.h"
+#include "unlink.h"
+#include "json5.h"
 
 // How many times to SIGTERM a process before SIGKILL
 #define TERM_ATTEMPTS 6
@@ -66,6 +82,48 @@
 #define MAX_CHILDREN	500
 // The default memory to provision for jobs (2MB)
 #define DEFAULT_PHYS_USAGE	(2*1024*1024)
+// How much job output to read per system call (the linux pipe capacity; see --read-size)
+#ifndef READ_BUFFER_SIZE
+#define READ_BUFFER_SIZE	(64*1024)
+#endif
+// Save buffered job output to the database once this much has accumulated (see --log-flush)
+#ifndef LOG_FLUSH_BYTES
+#define LOG_FLUSH_BYTES		(1024*1024)
+#endif
+// ... or once the oldest buffered output is this many seconds old (see --log-delay)
+#ifndef LOG_FLUSH_SECONDS
+#define LOG_FLUSH_SECONDS	1.0
+#endif
+// In batch mode, up to this much output per job is kept in memory, to write once it completes.
+// Output beyond this is replayed from the database instead.
+#ifndef REPLAY_LIMIT
+#define REPLAY_LIMIT		(1024*1024)
+#endif
+// How much of the end of a spilled stream to also keep in the database
+#define SPILL_TAIL		(64*1024)
+// Where --speculate makes a scratch directory for each job it starts early
+#define SPECULATE_DIR		".build/speculate"
+// How often (in seconds) --adaptive reconsiders the job limit
+#define ADAPT_INTERVAL		2
+// Stall percentages (PSI avg10) above which --adaptive lowers the job limit
+#define CPU_PRESSURE_HIGH	50.0
+#define MEM_PRESSURE_HIGH	10.0
+#define IO_PRESSURE_HIGH	50.0
+// ... and below which it may raise the job limit again
+#define CPU_PRESSURE_LOW	20.0
+#define MEM_PRESSURE_LOW	1.0
+#define IO_PRESSURE_LOW		20.0
+// Without PSI, the same decisions are made from the load average per CPU
+#define LOAD_HIGH		1.5
+#define LOAD_LOW		1.0
+// On pressure, the job limit is multiplied by this; otherwise it grows by one CPU
+#define ADAPT_BACKOFF		0.75
+// How often (in seconds) --memory-pause measures the memory used by jobs
+#define MEMORY_INTERVAL		1
+// Jobs are paused while less than this fraction of physical memory is available ...
+#define MEMORY_SHORT		0.05
+// ... and resumed once more than this is available (jobs must be as far within wake's share)
+#define MEMORY_AMPLE		0.15
 
 // #define DEBUG_PROGRESS
 
@@ -220,6 +278,45 @@ double Job::threads() const {
   return estimate;
 }
 
+// A job from the last run, started before it was requested (see --speculate)
+struct Speculation {
+  PriorJob prior;
+  std::vector<FileReflection> inputs; // as read by the last run
+  std::vector<std::string> outputs;   // as written by the last run
+  Scratch scratch;
+  RootPointer<Job> job;     // runs in the scratch directory
+  RootPointer<Job> adopter; // given to the interpreter once it requests the same job
+  std::string resources; // from the adopter's Plan, in case it must run again
+  long priority;         // likewise
+  bool done;     // the job has completed
+  bool fallback; // the result was unusable, so adopter runs again in the workspace
+  Speculation(PriorJob &&prior_, RootPointer<Job> &&job_, RootPointer<Job> &&adopter_)
+  : prior(std::move(prior_)), job(std::move(job_)), adopter(std::move(adopter_)), priority(0), done(false), fallback(false) { }
+};
+
+// A job_cache lookup; all those made before the interpreter runs dry are answered together
+struct Probe {
+  RootPointer<String> dir;
+  RootPointer<String> stdin_file;
+  RootPointer<String> env;
+  RootPointer<String> cmd;
+  RootPointer<String> visible;
+  RootPointer<String> res;
+  RootPointer<Continuation> output;
+  uint64_t signature;
+  long priority;
+  Probe(Heap &h, String *dir_, String *stdin_file_, String *env_, String *cmd_, String *visible_, String *res_, Continuation *output_, uint64_t signature_, long priority_)
+  : dir(h.root(dir_)), stdin_file(h.root(stdin_file_)), env(h.root(env_)), cmd(h.root(cmd_)), visible(h.root(visible_)), res(h.root(res_)), output(h.root(output_)), signature(signature_), priority(priority_) { }
+};
+
+// The declared resources a job holds while running, and how many of each
+struct Resource;
+typedef std::vector<std::pair<Resource*, long> > ResourceClaims;
+
+// Jobs which are pending or still running, ordered by the length of their critical path.
+// Each maps to its predicted runtime; a Job* would be moved by the garbage collector.
+typedef std::multimap<double, double> CriticalPaths;
+
 // A Task is a job that is not yet forked
 struct Task {
   RootPointer<Job> job;
@@ -227,11 +324,38 @@ struct Task {
   std::string stdin_file;
   std::string environ;
   std::string cmdline;
-  Task(RootPointer<Job> &&job_, const std::string &dir_, const std::string &stdin_file_, const std::string &environ_, const std::string &cmdline_)
-  : job(std::move(job_)), dir(dir_), stdin_file(stdin_file_), environ(environ_), cmdline(cmdline_) { }
+  ResourceClaims claims;
+  CriticalPaths::iterator critical;
+  struct timeval ready; // when the job was handed to the JobTable, with --job-stats
+  Speculation *speculation; // set for jobs started by --speculate (or their fallback)
+  bool speculative; // runs in a scratch directory, before being requested
+  long priority; // from the Plan; higher runs first
+  Task(RootPointer<Job> &&job_, const std::string &dir_, const std::string &stdin_file_, const std::string &environ_, const std::string &cmdline_, ResourceClaims &&claims_)
+  : job(std::move(job_)), dir(dir_), stdin_file(stdin_file_), environ(environ_), cmdline(cmdline_), claims(std::move(claims_)), speculation(nullptr), speculative(false), priority(0) { }
 };
 
+// A counted resource declared by the user (eg: "license/vcs=4")
+struct Resource {
+  long limit;
+  long active;
+  std::vector<std::unique_ptr<Task> > waiting; // blocked on this resource until a holder releases it
+  Resource() : limit(0), active(0) { }
+};
+
+// Like memory, a resource is only oversubscribed if nothing else holds it (to ensure progress)
+// Returns the first resource the claims cannot have yet, or nullptr if they can all be had
+static Resource *blocker(const ResourceClaims &claims) {
+  for (auto &c : claims)
+    if (c.first->active != 0 && c.first->active + c.second > c.first->limit)
+      return c.first;
+  return nullptr;
+}
+
 static bool operator < (const std::unique_ptr<Task> &x, const std::unique_ptr<Task> &y) {
+  // speculation only uses what requested jobs leave idle
+  if (x->speculative != y->speculative) return x->speculative;
+  // the user knows best which jobs matter most
+  if (x->priority != y->priority) return x->priority < y->priority;
   // anything with dependants on stderr/stdout is infinity (ie: run first)
   if (x->job->q_stdout || x->job->q_stderr) return false;
   if (y->job->q_stdout || y->job->q_stderr) return true;
@@ -243,25 +367,299 @@ static bool operator < (const std::unique_ptr<Task> &x, const std::unique_ptr<Ta
   return x->job->job < y->job->job;
 }
 
+// Output read from a job which is not yet in the database
+struct LogChunk {
+  int descriptor;
+  double seconds; // when the first byte was read, relative to job start
+  std::string output;
+  LogChunk(int descriptor_, double seconds_) : descriptor(descriptor_), seconds(seconds_) { }
+};
+
+// With --spill, output beyond 'limit' bytes per stream is written to files in 'dir'
+struct SpillPolicy {
+  uint64_t limit; // 0 if disabled
+  std::string dir;
+  SpillPolicy() : limit(0) { }
+};
+
+// How job output is read, and how long it is buffered before being saved to the database
+struct LogPolicy {
+  size_t read_size; // per system call
+  uint64_t flush_bytes;
+  double flush_seconds;
+  LogPolicy() : read_size(READ_BUFFER_SIZE), flush_bytes(LOG_FLUSH_BYTES), flush_seconds(LOG_FLUSH_SECONDS) { }
+};
+
+// The progress of one output stream of a job, for --spill
+struct SpillFile {
+  int fd; // -1 unless spilling
+  bool failed;
+  uint64_t bytes; // read from the job so far
+  std::string path; // temporary, until the stream is complete
+  std::string tail;
+  SpillFile() : fd(-1), failed(false), bytes(0) { }
+};
+
+// Splits one output stream of a job into whole lines for the status streams.
+// Complete lines are written straight from the read buffer; only a trailing partial line is kept.
+struct LineFramer {
+  std::string partial; // no newline, and shorter than limit
+  size_t limit; // a longer line is written as it arrives
+  LineFramer() : limit(READ_BUFFER_SIZE) { }
+  void feed(const char *stream, const char *data, size_t len);
+  void finish(const char *stream); // call once the descriptor is closed
+};
+
+void LineFramer::feed(const char *stream, const char *data, size_t len) {
+  // Only the new data can hold a newline, so it is the only data scanned
+  const char *end = data + len;
+  const char *split = data;
+  for (const char *nl; (nl = static_cast<const char*>(memchr(split, '\n', end - split))); split = nl+1) { }
+
+  // A line which does not fit is written as it arrives
+  if (partial.size() + (end - split) >= limit) split = end;
+
+  if (split != data) {
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char*>(partial.data());
+    iov[0].iov_len  = partial.size();
+    iov[1].iov_base = const_cast<char*>(data);
+    iov[1].iov_len  = split - data;
+    status_writev(stream, iov, 2);
+    partial.clear();
+  }
+  partial.append(split, end - split);
+}
+
+void LineFramer::finish(const char *stream) {
+  if (partial.empty()) return;
+  partial.push_back('\n');
+  status_write(stream, partial);
+  partial.clear();
+}
+
 // A JobEntry is a forked job with pid|stdout|stderr incomplete
 struct JobEntry {
   RootPointer<Job> job; // if unset, available for reuse
-  pid_t pid;       //  0 if merged
+  pid_t pid;       //  0 if merged, or not yet reported by the launcher
   int pipe_stdout; // -1 if closed
   int pipe_stderr; // -1 if closed
-  std::string stdout_buf;
-  std::string stderr_buf;
+  LineFramer stdout_lines;
+  LineFramer stderr_lines;
   std::string echo_line;
+  std::vector<LogChunk> log; // consecutive reads from one descriptor share a chunk
+  size_t log_bytes;
+  std::vector<LogChunk> replay; // all output so far, unless it exceeded replay_limit
+  size_t replay_bytes;
+  size_t replay_limit; // 0 unless in batch mode
+  const LogPolicy *log_policy;
+  const SpillPolicy *spill_policy;
+  SpillFile spill[2]; // stdout, stderr
+  ResourceClaims claims;
+  CriticalPaths::iterator critical; // valid until merged
   struct timeval start;
   std::list<Status>::iterator status;
-  JobEntry(RootPointer<Job> &&job_) : job(std::move(job_)), pid(0), pipe_stdout(-1), pipe_stderr(-1) { }
+  Speculation *speculation; // as in Task
+  bool discard; // an unwanted speculation; its output is not kept
+  long priority; // as in Task
+  bool paused; // stopped by --memory-pause
+  std::vector<pid_t> stopped; // processes sent SIGSTOP; they are continued even once reparented
+  uint64_t rss; // resident memory when last measured by --memory-pause
+  bool forking; // sent to the launcher, which has not reported its pid yet
+  JobEntry(RootPointer<Job> &&job_) : job(std::move(job_)), pid(0), pipe_stdout(-1), pipe_stderr(-1), log_bytes(0), replay_bytes(0), replay_limit(0), log_policy(nullptr), spill_policy(nullptr), speculation(nullptr), discard(false), priority(0), paused(false), rss(0), forking(false) { }
   double runtime(struct timeval now);
+  void save_output(int descriptor, const char *buffer, int size, double seconds);
+  void flush_output();
+  void finish_spill(int descriptor); // call once the descriptor is closed
+  void log_output(int descriptor, const char *buffer, int size, double seconds);
+  void keep_replay(int descriptor, const char *buffer, int size);
+  void write_replay() const; // call only if replay_bytes <= replay_limit
+  bool open_spill(int descriptor);
+  void write_spill(int descriptor, const char *buffer, int size);
 };
 
 double JobEntry::runtime(struct timeval now) {
   return now.tv_sec - start.tv_sec + (now.tv_usec - start.tv_usec)/1000000.0;
 }
 
+void JobEntry::save_output(int descriptor, const char *buffer, int size, double seconds) {
+  if (discard) return;
+  if (replay_limit) keep_replay(descriptor, buffer, size);
+  SpillFile &s = spill[descriptor-1];
+  uint64_t limit = spill_policy ? spill_policy->limit : 0;
+
+  // Output up to the limit is kept in the database, as usual
+  if (s.fd == -1 && (limit == 0 || s.failed || s.bytes + size <= limit)) {
+    s.bytes += size;
+    log_output(descriptor, buffer, size, seconds);
+    return;
+  }
+
+  if (s.bytes < limit) {
+    int keep = limit - s.bytes;
+    s.bytes += keep;
+    log_output(descriptor, buffer, keep, seconds);
+    buffer += keep;
+    size -= keep;
+  }
+
+  // The rest goes to a spill file, if one can be created
+  s.bytes += size;
+  if (s.fd == -1 && !open_spill(descriptor)) {
+    log_output(descriptor, buffer, size, seconds);
+  } else {
+    write_spill(descriptor, buffer, size);
+  }
+}
+
+bool JobEntry::open_spill(int descriptor) {
+  SpillFile &s = spill[descriptor-1];
+  s.path = spill_policy->dir + "/tmp.XXXXXX";
+  int err = mkdir_with_parents(spill_policy->dir, 0775);
+  if (err == 0) {
+    s.fd = mkstemp(&s.path[0]);
+    if (s.fd == -1) err = errno;
+  }
+
+  if (s.fd == -1) {
+    std::stringstream msg;
+    msg << "Could not spill output of job " << job->job << " to " << spill_policy->dir
+      << ": " << strerror(err) << std::endl;
+    status_write(STREAM_ERROR, msg.str());
+    s.failed = true;
+    s.path.clear();
+    return false;
+  }
+
+  int flags;
+  if ((flags = fcntl(s.fd, F_GETFD, 0)) != -1) fcntl(s.fd, F_SETFD, flags | FD_CLOEXEC);
+  return true;
+}
+
+void JobEntry::write_spill(int descriptor, const char *buffer, int size) {
+  SpillFile &s = spill[descriptor-1];
+
+  s.tail.append(buffer, size);
+  if (s.tail.size() > SPILL_TAIL) s.tail.erase(0, s.tail.size() - SPILL_TAIL);
+
+  // After a failed write, the rest of the stream is lost (but for the tail)
+  for (int done = 0; !s.failed && done < size; ) {
+    ssize_t got = write(s.fd, buffer + done, size - done);
+    if (got >= 0) {
+      done += got;
+    } else if (errno != EINTR) {
+      std::stringstream msg;
+      msg << "Could not spill output of job " << job->job << " to " << s.path
+        << ": " << strerror(errno) << std::endl;
+      status_write(STREAM_ERROR, msg.str());
+      s.failed = true;
+    }
+  }
+}
+
+void JobEntry::finish_spill(int descriptor) {
+  SpillFile &s = spill[descriptor-1];
+  if (s.fd == -1) return;
+
+  if (discard) {
+    close(s.fd);
+    unlink(s.path.c_str());
+    s.fd = -1;
+    return;
+  }
+
+  // Name the file by its content, so that identical output is only kept once
+  struct stat st;
+  size_t bytes = fstat(s.fd, &st) == 0 ? st.st_size : 0;
+  void *map = bytes ? mmap(0, bytes, PROT_READ, MAP_PRIVATE, s.fd, 0) : MAP_FAILED;
+  Hash hash;
+  if (map != MAP_FAILED) {
+    hash = Hash(map, bytes);
+    munmap(map, bytes);
+  }
+  close(s.fd);
+  s.fd = -1;
+
+  char name[33];
+  snprintf(name, sizeof(name), "%016llx%016llx",
+    (unsigned long long)hash.data[0], (unsigned long long)hash.data[1]);
+  std::string path = spill_policy->dir + "/" + name;
+  if (access(path.c_str(), R_OK) == 0) {
+    unlink(s.path.c_str());
+  } else if (rename(s.path.c_str(), path.c_str()) != 0) {
+    path = s.path;
+  }
+
+  job->db->save_spill(job->job, descriptor, path, bytes, s.tail);
+  s.path.clear();
+}
+
+void JobEntry::log_output(int descriptor, const char *buffer, int size, double seconds) {
+  if (size == 0) return;
+  if (log.empty() || log.back().descriptor != descriptor)
+    log.emplace_back(descriptor, seconds);
+  log.back().output.append(buffer, size);
+  log_bytes += size;
+  if (log_bytes >= log_policy->flush_bytes || seconds - log.front().seconds >= log_policy->flush_seconds)
+    flush_output();
+}
+
+void JobEntry::keep_replay(int descriptor, const char *buffer, int size) {
+  replay_bytes += size;
+  if (replay_bytes > replay_limit) {
+    std::vector<LogChunk>().swap(replay);
+    return;
+  }
+  if (replay.empty() || replay.back().descriptor != descriptor)
+    replay.emplace_back(descriptor, 0);
+  replay.back().output.append(buffer, size);
+}
+
+// Write the echo line and output, just as Database::replay_output would, but in fewer writes
+void JobEntry::write_replay() const {
+  std::vector<std::pair<const char*, struct iovec> > pieces;
+  auto add = [&](const char *stream, const char *data, size_t len) {
+    if (len == 0) return;
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(data);
+    iov.iov_len = len;
+    pieces.emplace_back(stream, iov);
+  };
+
+  const char *out = job->stream_out.c_str();
+  const char *err = job->stream_err.c_str();
+  bool needlf[2] = { false, false };
+  add(job->echo.c_str(), echo_line.data(), echo_line.size());
+  for (auto &chunk : replay) {
+    add(chunk.descriptor == 2 ? err : out, chunk.output.data(), chunk.output.size());
+    if (!chunk.output.empty()) needlf[chunk.descriptor-1] = chunk.output.back() != '\n';
+  }
+  if (needlf[0]) add(out, "\n", 1);
+  if (needlf[1]) add(err, "\n", 1);
+
+  // Consecutive pieces bound for the same stream are written together
+  struct iovec iov[STATUS_MAX_IOV];
+  for (size_t p = 0; p < pieces.size(); ) {
+    const char *stream = pieces[p].first;
+    int n = 0;
+    for (; p < pieces.size() && n < STATUS_MAX_IOV && !strcmp(pieces[p].first, stream); ++p)
+      iov[n++] = pieces[p].second;
+    status_writev(stream, iov, n);
+  }
+}
+
+void JobEntry::flush_output() {
+  if (discard) log.clear();
+  if (log.empty()) return;
+  Database *db = job->db;
+  db->begin_txn();
+  for (auto &chunk : log)
+    db->save_output(job->job, chunk.descriptor, chunk.output.data(), chunk.output.size(), chunk.seconds);
+  db->end_txn();
+  log.clear();
+  log_bytes = 0;
+}
+
 struct CriticalJob {
   double pathtime;
   double runtime;
@@ -271,10 +669,39 @@ struct CriticalJob {
 struct JobTable::detail {
   std::list<JobEntry> running;
   std::vector<std::unique_ptr<Task> > pending;
-  sigset_t block; // signals that can race with pselect()
+  std::unordered_map<int, std::list<JobEntry>::iterator> pipes; // open pipe => owner
+  std::unordered_map<pid_t, std::list<JobEntry>::iterator> pids; // unmerged child => owner
+  Poll poll; // watches every fd in pipes
+  sigset_t block; // signals that can race with poll.wait()
   Database *db;
+  std::map<std::string, Resource> resources; // by name
+  CriticalPaths critical; // every job in pending, or in running and not yet merged
   double active, limit; // CPUs
+  double ceiling; // the largest limit --adaptive may choose
+  bool adaptive;
+  struct timeval epoch, adapted; // when the JobTable was created, and the limit last reconsidered
+  Profile *profile; // records limit changes, if not null
+  JobCgroups cgroups; // see --cgroups
+  LogPolicy log; // see --read-size, --log-flush and --log-delay
+  std::vector<char> buffer; // for reading job output; log.read_size bytes
+  SpillPolicy spill; // see --spill
+  std::list<Speculation> speculations; // see --speculate; unrequested, or not yet settled
+  bool speculated; // speculate() started any jobs
+  std::vector<Probe> probes; // job_cache lookups not yet answered
+  Launcher launcher; // forks jobs, once started
+  std::deque<std::list<JobEntry>::iterator> forking; // sent to the launcher, in order
+  bool launcher_tried;
+  bool stats; // see --job-stats
+  bool telemetry; // STREAM_TELEMETRY is written somewhere
+  std::vector<double> latency; // seconds from ready to spawned, per job
+  double busy; // seconds in wait(), but not blocked in poll
+  struct timeval first, last; // first job spawned and last job reaped
   uint64_t phys_active, phys_limit; // memory
+  uint64_t phys_total; // of the machine
+  bool memory_pause; // see --memory-pause
+  int paused; // jobs currently stopped for lack of memory
+  struct timeval measured; // when --memory-pause last measured memory use
+  ProcessTable procs; // used to find the processes of a job without cgroups
   long max_children; // hard cap on jobs allowed
   bool debug;
   bool verbose;
@@ -282,7 +709,6 @@ struct JobTable::detail {
   bool check;
   bool batch;
   struct timeval wall;
-  RUsage childrenUsage;
 
   CriticalJob critJob(double nexttime) const;
 };
@@ -291,21 +717,33 @@ CriticalJob JobTable::detail::critJob(double nexttime) const {
   CriticalJob out;
   out.pathtime = nexttime;
   out.runtime = 0;
-  for (auto &j : running) {
-    if (j.pid && j.job->pathtime > out.pathtime) {
-      out.pathtime = j.job->pathtime;
-      out.runtime = j.job->record.runtime;
-    }
-  }
-  for (auto &j : pending) {
-    if (j->job->pathtime > out.pathtime) {
-      out.pathtime = j->job->pathtime;
-      out.runtime = j->job->record.runtime;
-    }
+  if (!critical.empty() && critical.rbegin()->first > nexttime) {
+    out.pathtime = critical.rbegin()->first;
+    out.runtime = critical.rbegin()->second;
   }
   return out;
 }
 
+// Stop (or continue) every process of a running job
+static void pause_job(JobTable::detail *imp, JobEntry &i, bool paused) {
+  if (i.paused == paused) return;
+  i.paused = paused;
+  imp->paused += paused ? 1 : -1;
+
+  if (imp->cgroups.freeze(i.job->job, paused) || (paused && i.pid == 0)) return;
+
+  // Without the freezer, stop the job and its descendants; parents first, so none can fork more.
+  // Continue exactly those, since the job's main process may have been reaped since.
+  if (paused) {
+    imp->procs.scan();
+    i.stopped = imp->procs.tree(i.pid);
+    for (pid_t pid : i.stopped) kill(pid, SIGSTOP);
+  } else {
+    for (pid_t pid : i.stopped) kill(pid, SIGCONT);
+    i.stopped.clear();
+  }
+}
+
 static volatile bool child_ready = false;
 static volatile bool exit_asap = false;
 
@@ -323,7 +761,69 @@ bool JobTable::exit_now() {
   return exit_asap;
 }
 
-JobTable::JobTable(Database *db, double percent, bool debug, bool verbose, bool quiet, bool check, bool batch) : imp(new JobTable::detail) {
+void JobTable::add_resource(const std::string &name, long limit) {
+  imp->resources[name].limit = limit;
+}
+
+void JobTable::use_cgroups(bool limit_memory) {
+  std::string why;
+  bool ok = imp->cgroups.init(limit_memory, why);
+  if (!why.empty())
+    std::cerr << "wake: " << (ok ? "" : "not using cgroups, because ") << why << std::endl;
+}
+
+void JobTable::pause_on_memory() {
+  imp->memory_pause = true;
+}
+
+void JobTable::buffer_output(size_t read_size, uint64_t flush_bytes, double flush_seconds) {
+  if (read_size) imp->log.read_size = read_size;
+  if (flush_bytes) imp->log.flush_bytes = flush_bytes;
+  if (flush_seconds >= 0) imp->log.flush_seconds = flush_seconds;
+}
+
+void JobTable::spill_output(uint64_t limit, const std::string &dir) {
+  imp->spill.limit = limit;
+  imp->spill.dir = dir;
+}
+
+void JobTable::record_stats() {
+  imp->stats = true;
+}
+
+void JobTable::report_stats() {
+  if (!imp->stats) return;
+
+  auto &latency = imp->latency;
+  std::sort(latency.begin(), latency.end());
+  auto percentile = [&latency](double p) {
+    return latency.empty() ? 0 : latency[std::min(latency.size() - 1, (size_t)(p * latency.size()))];
+  };
+
+  double span = latency.empty() ? 0 :
+    (imp->last.tv_sec - imp->first.tv_sec) + (imp->last.tv_usec - imp->first.tv_usec) / 1000000.0;
+  double writing, stalled, cleaning;
+  imp->db->timings(writing, stalled, cleaning);
+  struct rusage self;
+  getrusage(RUSAGE_SELF, &self);
+
+  std::stringstream s;
+  s << "------------------------------------------" << std::endl;
+  s << "Jobs launched   " << latency.size() << " in " << span << "s";
+  if (span > 0) s << " (" << latency.size() / span << " jobs/s)";
+  s << std::endl;
+  s << "Launch latency  p50 " << 1000*percentile(0.5) << "ms, p90 " << 1000*percentile(0.9)
+    << "ms, p99 " << 1000*percentile(0.99) << "ms, max " << 1000*percentile(1) << "ms" << std::endl;
+  s << "Scheduler time  " << imp->busy << "s (launching and reaping jobs, excluding idle)" << std::endl;
+  s << "Database time   " << writing << "s writing, " << stalled << "s stalled on writes, "
+    << cleaning << "s cleaning up" << std::endl;
+  s << "CPU time        " << (self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1000000.0) << "s user, "
+    << (self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1000000.0) << "s system (wake itself)" << std::endl;
+  s << "------------------------------------------" << std::endl;
+  status_write(STREAM_REPORT, s.str());
+}
+
+JobTable::JobTable(Database *db, double percent, bool debug, bool verbose, bool quiet, bool check, bool batch, bool adaptive, Profile *profile) : imp(new JobTable::detail) {
   imp->debug = debug;
   imp->verbose = verbose;
   imp->quiet = quiet;
@@ -333,7 +833,29 @@ JobTable::JobTable(Database *db, double percent, bool debug, bool verbose, bool
   imp->active = 0;
   imp->limit = std::thread::hardware_concurrency() * percent;
   imp->phys_active = 0;
-  imp->phys_limit = get_physical_memory() * percent;
+  imp->phys_total = get_physical_memory();
+  imp->phys_limit = imp->phys_total * percent;
+  imp->memory_pause = false;
+  imp->paused = 0;
+  imp->adaptive = adaptive;
+  imp->profile = profile;
+  imp->launcher_tried = false;
+  imp->speculated = false;
+  imp->stats = false;
+  imp->telemetry = status_enabled(STREAM_TELEMETRY);
+  imp->busy = 0;
+  gettimeofday(&imp->epoch, 0);
+  imp->adapted = imp->epoch;
+  imp->measured = imp->epoch;
+
+  // A container may be granted less of the machine than it can see
+  if (adaptive) {
+    double cpus = get_cgroup_cpus();
+    uint64_t memory = get_cgroup_memory();
+    if (cpus > 0 && cpus * percent < imp->limit) imp->limit = cpus * percent;
+    if (memory > 0 && memory * percent < imp->phys_limit) imp->phys_limit = memory * percent;
+  }
+  imp->ceiling = imp->limit;
 
   sigemptyset(&imp->block);
 
@@ -405,7 +927,7 @@ JobTable::JobTable(Database *db, double percent, bool debug, bool verbose, bool
   // We want 2 descriptors (stdout+stderr) per job.
   rlim_t requested = imp->max_children * 2 + MAX_SELF_FDS;
   rlim_t maximum = (limit.rlim_max == RLIM_INFINITY) ? OPEN_MAX : limit.rlim_max;
-  if (maximum > FD_SETSIZE) maximum = FD_SETSIZE;
+  if (maximum > (rlim_t)imp->poll.max_fds()) maximum = imp->poll.max_fds();
 
   if (maximum < requested) {
     requested = maximum;
@@ -452,6 +974,26 @@ static struct timeval mytimerdouble(struct timeval a) {
   return a;
 }
 
+// The launcher reports pids in the order jobs were sent to it
+static void record_spawned(JobTable::detail *imp, bool block) {
+  while (!imp->forking.empty()) {
+    pid_t pid = imp->launcher.spawned(block);
+    if (pid == 0) break;
+    if (pid == -1) {
+      perror("wake job launcher fork");
+      exit(1);
+    }
+    auto entry = imp->forking.front();
+    imp->forking.pop_front();
+    JobEntry &i = *entry;
+    i.forking = false;
+    i.job->pid = i.pid = pid;
+    imp->pids[pid] = entry;
+    // A speculation discarded before its pid arrived must still be stopped
+    if (i.discard) kill(pid, SIGTERM);
+  }
+}
+
 JobTable::~JobTable() {
   // Disable the status refresh signal
   struct itimerval timer;
@@ -469,10 +1011,12 @@ JobTable::~JobTable() {
     children = false;
 
     // Send every child SIGTERM
+    record_spawned(imp.get(), true);
     for (auto &i : imp->running) {
       if (i.pid == 0) continue;
       children = true;
       kill(i.pid, SIGTERM);
+      pause_job(imp.get(), i, false); // a stopped process cannot act on SIGTERM
     }
 
     // Reap children for one second; exit early if none remain
@@ -489,28 +1033,47 @@ JobTable::~JobTable() {
       timeout.tv_sec = 0;
       timeout.tv_nsec = remain.tv_usec * 1000;
 
+      // Jobs started by the launcher are reported on its socket
+      fd_set set;
+      int launcher = imp->launcher.fd();
+      FD_ZERO(&set);
+      if (launcher != -1) FD_SET(launcher, &set);
+
       // Sleep until timeout or a signal arrives
-      if (!child_ready) pselect(0, 0, 0, 0, &timeout, &saved);
+      if (!child_ready && !imp->launcher.pending()) pselect(launcher+1, &set, 0, 0, &timeout, &saved);
 
       // Restore signals
       child_ready = false;
       sigaddset(&saved, SIGCHLD);
       sigprocmask(SIG_SETMASK, &saved, 0);
 
+      // If the launcher is gone, no more exits will be reported; SIGKILL the rest
+      if (!imp->launcher.receive()) break;
+
       pid_t pid;
       int status;
-      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      RUsage usage;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0 || (pid = imp->launcher.reap(&status, &usage)) > 0) {
         if (WIFSTOPPED(status)) continue;
 
-        children = false;
-        for (auto &i : imp->running) {
-          if (i.pid == pid) i.pid = 0;
-          if (i.pid != 0) children = true;
+        auto owner = imp->pids.find(pid);
+        if (owner != imp->pids.end()) {
+          owner->second->pid = 0;
+          imp->cgroups.release(owner->second->job->job);
+          imp->pids.erase(owner);
         }
+        children = !imp->pids.empty();
       }
     }
   }
 
+  // Keep whatever output the children produced
+  for (auto &i : imp->running) {
+    i.flush_output();
+    i.finish_spill(1);
+    i.finish_spill(2);
+  }
+
   // Force children to die
   for (auto &i : imp->running) {
     if (i.pid == 0) continue;
@@ -518,7 +1081,11 @@ JobTable::~JobTable() {
     s << "Force killing " << i.pid << " after " << TERM_ATTEMPTS << " attempts with SIGTERM" << std::endl;
     status_write(STREAM_ERROR, s.str());
     kill(i.pid, SIGKILL);
+    imp->cgroups.release(i.job->job);
   }
+
+  // Whatever speculation remains was never used
+  if (imp->speculated) deep_unlink(AT_FDCWD, SPECULATE_DIR);
 }
 
 static char **split_null(std::string &str) {
@@ -553,6 +1120,38 @@ static std::string pretty_cmd(const std::string &x) {
   return out.str();
 }
 
+// Describe a scheduling event, and the state of the scheduler after it, as one line of JSON
+static void telemetry(JobTable::detail *imp, const char *event, Job *job) {
+  struct timeval now;
+  gettimeofday(&now, 0);
+  double writing, stalled, cleaning;
+  imp->db->timings(writing, stalled, cleaning);
+
+  std::stringstream s;
+  s << "{\"time\":" << now.tv_sec << "." << std::setfill('0') << std::setw(6) << now.tv_usec
+    << ",\"event\":\"" << event << "\""
+    << ",\"job\":" << job->job
+    << ",\"label\":\"" << json_escape(job->label->as_str()) << "\"";
+  if (job->state & STATE_MERGED)
+    s << ",\"status\":" << job->reality.status
+      << ",\"runtime\":" << job->reality.runtime
+      << ",\"cputime\":" << job->reality.cputime
+      << ",\"membytes\":" << job->reality.membytes;
+  size_t pending = imp->pending.size();
+  for (auto &r : imp->resources) pending += r.second.waiting.size();
+  s << ",\"pending\":" << pending
+    << ",\"running\":" << imp->running.size()
+    << ",\"cpus\":" << imp->active
+    << ",\"cpu_limit\":" << imp->limit
+    << ",\"memory\":" << imp->phys_active
+    << ",\"memory_limit\":" << imp->phys_limit
+    << ",\"remain\":" << status_state.remain
+    << ",\"db_write\":" << writing
+    << ",\"db_stall\":" << stalled
+    << "}" << std::endl;
+  status_write(STREAM_TELEMETRY, s.str());
+}
+
 static void launch(JobTable *jobtable) {
   // Note: We schedule jobs whenever we are under CPU quota, without considering if the
   // new job will cause us to exceed the quota. This is necessary, for two reasons:
@@ -566,17 +1165,52 @@ static void launch(JobTable *jobtable) {
   //   - exceeding memory would slow down the build due to thrashing
   //   - RAM is never "wasted" (disk cache / etc), so just wait for the next critical job
   //   - even if a job uses more memory than the system has, eventually attempt it anyway (progress)
+  // Declared resources are different; a job waiting for one must not hold up unrelated jobs.
+  // So those jobs wait on the resource until it is released, and the next most critical job is considered instead.
   auto &heap = jobtable->imp->pending;
+
+  // Start the job launcher along with the first job
+  if (!jobtable->imp->launcher_tried && !heap.empty()) {
+    jobtable->imp->launcher_tried = true;
+    std::string why;
+    if (jobtable->imp->launcher.start(find_execpath() + "/../lib/wake/shim-wake", why)) {
+      jobtable->imp->poll.add(jobtable->imp->launcher.fd());
+    } else {
+      std::cerr << "wake: spawning jobs directly, because " << why << std::endl;
+    }
+  }
+
   while (!heap.empty()
       && jobtable->imp->running.size() < (size_t)jobtable->imp->max_children
       && jobtable->imp->active < jobtable->imp->limit
+      && jobtable->imp->paused == 0
       && (jobtable->imp->phys_active == 0 || jobtable->imp->phys_active + heap.front()->job->memory() < jobtable->imp->phys_limit)) {
+    if (Resource *busy = blocker(heap.front()->claims)) {
+      std::pop_heap(heap.begin(), heap.end());
+      busy->waiting.emplace_back(std::move(heap.back()));
+      heap.pop_back();
+      continue;
+    }
+
     Task &task = *heap.front();
     jobtable->imp->active += task.job->threads();
     jobtable->imp->phys_active += task.job->memory();
-
-    jobtable->imp->running.emplace_back(std::move(task.job));
-    JobEntry &i = jobtable->imp->running.back();
+    for (auto &c : task.claims) c.first->active += c.second;
+
+    auto entry = jobtable->imp->running.emplace(jobtable->imp->running.end(), std::move(task.job));
+    JobEntry &i = *entry;
+    i.claims = std::move(task.claims);
+    i.critical = task.critical;
+    i.log_policy = &jobtable->imp->log;
+    i.spill_policy = &jobtable->imp->spill;
+    i.stdout_lines.limit = i.stderr_lines.limit = jobtable->imp->log.read_size;
+    if (jobtable->imp->batch) {
+      // Spilled output is only replayed from the database
+      uint64_t spill = jobtable->imp->spill.limit;
+      i.replay_limit = spill && spill < REPLAY_LIMIT ? spill : REPLAY_LIMIT;
+    }
+    i.speculation = task.speculation;
+    i.priority = task.priority;
 
     int pipe_stdout[2];
     int pipe_stderr[2];
@@ -589,27 +1223,58 @@ static void launch(JobTable *jobtable) {
     if ((flags = fcntl(pipe_stderr[0], F_GETFD, 0)) != -1) fcntl(pipe_stderr[0], F_SETFD, flags | FD_CLOEXEC);
     i.pipe_stdout = pipe_stdout[0];
     i.pipe_stderr = pipe_stderr[0];
+    jobtable->imp->pipes[i.pipe_stdout] = entry;
+    jobtable->imp->pipes[i.pipe_stderr] = entry;
+    jobtable->imp->poll.add(i.pipe_stdout);
+    jobtable->imp->poll.add(i.pipe_stderr);
     gettimeofday(&i.start, 0);
-    std::stringstream prelude;
-    prelude << find_execpath() << "/../lib/wake/shim-wake" << '\0'
-      << (task.stdin_file.empty() ? "/dev/null" : task.stdin_file.c_str()) << '\0'
-      << std::to_string(pipe_stdout[1]) << '\0'
-      << std::to_string(pipe_stderr[1]) << '\0'
-      << task.dir << '\0';
-    std::string shim = prelude.str() + task.cmdline;
-    auto cmdline = split_null(shim);
-    auto environ = split_null(task.environ);
-
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGCHLD);
-    sigprocmask(SIG_UNBLOCK, &set, 0);
-    pid_t pid = wake_spawn(cmdline[0], cmdline, environ);
-    sigprocmask(SIG_BLOCK, &set, 0);
-
-    delete [] cmdline;
-    delete [] environ;
+    int procs = jobtable->imp->cgroups.enabled() ? jobtable->imp->cgroups.create(i.job->job, i.job->predict.membytes) : -1;
+    pid_t pid;
+    if (jobtable->imp->launcher.fd() != -1) {
+      // The pid arrives later (see record_spawned), so launching does not wait for fork
+      jobtable->imp->launcher.spawn(
+        task.dir,
+        task.stdin_file.empty() ? "/dev/null" : task.stdin_file,
+        pipe_stdout[1],
+        pipe_stderr[1],
+        procs,
+        task.cmdline,
+        task.environ);
+      jobtable->imp->forking.push_back(entry);
+      i.forking = true;
+      pid = 0;
+    } else {
+      std::stringstream prelude;
+      prelude << find_execpath() << "/../lib/wake/shim-wake" << '\0'
+        << (task.stdin_file.empty() ? "/dev/null" : task.stdin_file.c_str()) << '\0'
+        << std::to_string(pipe_stdout[1]) << '\0'
+        << std::to_string(pipe_stderr[1]) << '\0'
+        << task.dir << '\0';
+      std::string shim = prelude.str() + task.cmdline;
+      auto cmdline = split_null(shim);
+      auto environ = split_null(task.environ);
+
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGCHLD);
+      sigprocmask(SIG_UNBLOCK, &set, 0);
+      pid = wake_spawn(cmdline[0], cmdline, environ, procs);
+      sigprocmask(SIG_BLOCK, &set, 0);
+
+      delete [] cmdline;
+      delete [] environ;
+    }
+    if (procs != -1) close(procs);
+
     i.job->pid = i.pid = pid;
+    if (jobtable->imp->stats) {
+      struct timeval now;
+      gettimeofday(&now, 0);
+      if (jobtable->imp->latency.empty()) jobtable->imp->first = now;
+      jobtable->imp->latency.push_back(
+        (now.tv_sec - task.ready.tv_sec) + (now.tv_usec - task.ready.tv_usec) / 1000000.0);
+    }
+    if (!i.forking) jobtable->imp->pids[pid] = entry;
     i.job->state |= STATE_FORKED;
     close(pipe_stdout[1]);
     close(pipe_stderr[1]);
@@ -652,19 +1317,386 @@ static void launch(JobTable *jobtable) {
 
     std::pop_heap(heap.begin(), heap.end());
     heap.resize(heap.size()-1);
+    if (jobtable->imp->telemetry) telemetry(jobtable->imp.get(), "launched", i.job.get());
+  }
+}
+
+// Paths which cannot escape the workspace (and so stay inside a scratch directory)
+static bool contained(const std::string &path) {
+  if (path.empty() || path[0] == '/') return false;
+  std::stringstream parts(path);
+  std::string part;
+  while (std::getline(parts, part, '/'))
+    if (part == "..") return false;
+  return true;
+}
+
+static std::string null_join(const std::vector<FileReflection> &files) {
+  std::string out;
+  for (auto &f : files) {
+    out.append(f.path);
+    out.push_back(0);
+  }
+  return out;
+}
+
+static void queue_task(JobTable::detail *imp, Task *task) {
+  imp->pending.emplace_back(task);
+  task->critical = imp->critical.emplace(task->job->pathtime, task->job->record.runtime);
+  if (imp->stats) gettimeofday(&task->ready, 0);
+  std::push_heap(imp->pending.begin(), imp->pending.end());
+  if (imp->telemetry) telemetry(imp, "queued", task->job.get());
+}
+
+// Give up on a speculation, stopping its job if it was started
+static void discard(JobTable::detail *imp, std::list<Speculation>::iterator s) {
+  Speculation *spec = &*s;
+  auto ours = [=](const std::unique_ptr<Task> &t) { return t->speculation == spec; };
+  auto &heap = imp->pending;
+  auto task = std::find_if(heap.begin(), heap.end(), ours);
+  bool started = task == heap.end();
+  if (!started) {
+    imp->critical.erase((*task)->critical);
+    heap.erase(task);
+    std::make_heap(heap.begin(), heap.end());
+  }
+  // A fallback may instead be waiting on a declared resource
+  for (auto &r : imp->resources) {
+    auto &waiting = r.second.waiting;
+    auto blocked = std::find_if(waiting.begin(), waiting.end(), ours);
+    if (blocked == waiting.end()) continue;
+    started = false;
+    imp->critical.erase((*blocked)->critical);
+    waiting.erase(blocked);
+  }
+
+  for (auto &i : imp->running) {
+    if (i.speculation != spec) continue;
+    i.speculation = nullptr;
+    i.discard = true;
+    if (i.pid) kill(i.pid, SIGTERM);
+    pause_job(imp, i, false);
+  }
+
+  // A job which is still stopping keeps its scratch directory until wake exits
+  if (!started || s->done) s->scratch.remove();
+  imp->db->forget_job(s->job->job);
+  imp->speculations.erase(s);
+}
+
+// True if every job running or waiting to run is a speculation nobody has requested
+static bool only_speculating(const JobTable::detail *imp) {
+  for (auto &i : imp->running)
+    if (!i.discard && !(i.speculation && !i.speculation->adopter)) return false;
+  for (auto &t : imp->pending)
+    if (!(t->speculation && !t->speculation->adopter)) return false;
+  for (auto &r : imp->resources)
+    for (auto &t : r.second.waiting)
+      if (!(t->speculation && !t->speculation->adopter)) return false;
+  return true;
+}
+
+// Hash the files written by a job and record them, as the wake code does for a Runner's outputs
+static bool record_outputs(JobTable::detail *imp, const std::vector<std::string> &files, std::string &outputs, std::string &why) {
+  std::string shim = find_execpath() + "/../lib/wake/shim-wake";
+  bool ok = true;
+  for (auto &file : files) {
+    std::string hash = hash_file(shim, file);
+    if (hash.empty()) {
+      why = "'" + file + "' could not be hashed";
+      ok = false;
+      continue;
+    }
+    imp->db->add_hash(file, hash, getmtime_ns(file.c_str()));
+    outputs.append(file);
+    outputs.push_back(0);
+  }
+  return ok;
+}
+
+// Resources are "name" or "name=count"; those not declared to the JobTable are left to the runner
+static ResourceClaims parse_claims(JobTable::detail *imp, const std::string &res) {
+  ResourceClaims out;
+  const char *tok = res.c_str();
+  const char *end = tok + res.size();
+  for (const char *scan = tok; scan != end; ++scan) {
+    if (*scan == 0 && scan != tok) {
+      std::string name(tok, scan-tok);
+      long count = 1;
+      size_t eq = name.find_last_of('=');
+      if (eq != std::string::npos) {
+        char *tail;
+        long x = strtol(name.c_str() + eq + 1, &tail, 10);
+        if (!*tail && x > 0 && tail != name.c_str() + eq + 1) {
+          count = x;
+          name.resize(eq);
+        }
+      }
+      auto it = imp->resources.find(name);
+      if (it != imp->resources.end())
+        out.emplace_back(&it->second, count);
+      tok = scan+1;
+    }
+  }
+  return out;
+}
+
+// The early run is unusable, but the interpreter already waits on its result, so run it again for real
+static void fall_back(JobTable::detail *imp, Heap &heap, std::list<Speculation>::iterator s, const std::string &why) {
+  std::stringstream msg;
+  msg << "wake: discarded the speculative run of job " << s->job->job
+    << " because " << why << "; running it again" << std::endl;
+  status_write(STREAM_LOG, msg.str());
+
+  imp->db->forget_job(s->job->job);
+  s->scratch.remove();
+  s->done = false;
+  s->fallback = true;
+
+  const PriorJob &prior = s->prior;
+  Job *adopter = s->adopter.get();
+  adopter->state = 0;
+  imp->db->insert_job(
+    prior.directory,
+    prior.commandline,
+    prior.environment,
+    prior.stdin_file,
+    prior.signature,
+    prior.label,
+    prior.stack,
+    null_join(s->inputs),
+    &adopter->job);
+
+  Task *task = new Task(heap.root(adopter), prior.directory, prior.stdin_file, prior.environment, prior.commandline, parse_claims(imp, s->resources));
+  task->speculation = &*s;
+  task->priority = s->priority;
+  queue_task(imp, task);
+}
+
+// Finish an adopted speculation (or its fallback) which has completed
+static void settle(JobTable::detail *imp, Runtime &runtime, std::list<Speculation>::iterator s) {
+  runtime.heap.guarantee(WJob::reserve());
+  Job *adopter = s->adopter.get();
+  Job *job = s->fallback ? adopter : s->job.get();
+  std::string outputs, why;
+
+  if (s->fallback) {
+    // Run in the workspace, only the files written last time can be recognized as outputs
+    std::vector<std::string> wrote;
+    for (auto &output : s->outputs)
+      if (access(output.c_str(), F_OK) == 0)
+        wrote.push_back(output);
+    record_outputs(imp, wrote, outputs, why);
+  } else {
+    // The job must succeed and write what it wrote last time. Nothing else is kept:
+    // the signature matched, so the Plan's FnOutputs chose exactly these files last time.
+    bool ok = job->reality.status == 0;
+    if (!ok) why = "it failed with status " + std::to_string(job->reality.status);
+    for (auto &output : s->outputs) {
+      if (ok && !s->scratch.has(output)) {
+        why = "it did not write '" + output + "'";
+        ok = false;
+      }
+    }
+    if (!ok || !s->scratch.publish(s->outputs, why) || !record_outputs(imp, s->outputs, outputs, why)) {
+      fall_back(imp, runtime.heap, s, why);
+      return;
+    }
+  }
+
+  job->report = job->reality;
+  bool keep = job->keep && job->report.status == 0;
+  imp->db->finish_job(job->job, null_join(s->inputs), outputs, job->code.data[0], keep, job->report);
+
+  adopter->job = job->job;
+  adopter->reality = job->reality;
+  adopter->report = job->report;
+  adopter->state |= STATE_FORKED|STATE_STDOUT|STATE_STDERR|STATE_MERGED|STATE_FINISHED;
+  runtime.schedule(WJob::claim(runtime.heap, adopter));
+
+  s->scratch.remove();
+  imp->speculations.erase(s);
+}
+
+// A speculation's job (or its fallback) has completed
+static void completed(JobTable::detail *imp, Runtime &runtime, Speculation *spec) {
+  auto s = std::find_if(imp->speculations.begin(), imp->speculations.end(),
+    [=](const Speculation &x) { return &x == spec; });
+  if (s == imp->speculations.end()) return;
+
+  s->done = true;
+  if (s->adopter) {
+    settle(imp, runtime, s);
+  } else if (s->job->reality.status != 0) {
+    // Without its request, there is no way to tell the failure apart from a problem with speculation
+    discard(imp, s);
   }
 }
 
+// If a speculation matches a request (which missed the cache), hand its job to the interpreter.
+// The caller must have reserved space for a Job and a WJob.
+static Job *adopt(JobTable::detail *imp, Runtime &runtime, String *dir, String *stdin_file, String *env, String *cmd, uint64_t signature, const std::string &visible, const std::string &resources, long priority) {
+  auto s = imp->speculations.begin();
+  for (; s != imp->speculations.end(); ++s) {
+    if (!s->adopter
+        && s->prior.directory   == dir->as_str()
+        && s->prior.commandline == cmd->as_str()
+        && s->prior.environment == env->as_str()
+        && s->prior.stdin_file  == stdin_file->as_str()) break;
+  }
+  if (s == imp->speculations.end()) return nullptr;
+
+  std::unordered_set<std::string> vis;
+  const char *tok = visible.c_str();
+  const char *end = tok + visible.size();
+  for (const char *scan = tok; scan != end; ++scan) {
+    if (*scan == 0 && scan != tok) {
+      vis.emplace(tok, scan-tok);
+      tok = scan+1;
+    }
+  }
+
+  // Everything the job read must still be visible to it, and unchanged
+  bool ok = s->prior.signature == signature && !(s->done && s->job->reality.status != 0);
+  for (auto &input : s->inputs) {
+    if (!ok) break;
+    ok = vis.find(input.path) != vis.end()
+      && imp->db->get_hash(input.path, getmtime_ns(input.path.c_str())) == input.hash;
+  }
+  if (!ok) {
+    discard(imp, s);
+    return nullptr;
+  }
+
+  Job *adopter = Job::claim(runtime.heap, imp->db, s->job->label.get(), dir, stdin_file, env, cmd, true, STREAM_ECHO, STREAM_INFO, STREAM_WARNING);
+  adopter->state = STATE_FORKED;
+  adopter->job = s->job->job;
+  adopter->record = s->job->record;
+  adopter->predict = s->job->predict;
+  adopter->pathtime = s->job->pathtime;
+  s->adopter = adopter;
+  s->resources = resources;
+  s->priority = priority;
+  if (s->done) settle(imp, runtime, s);
+  return adopter;
+}
+
+void JobTable::speculate(Runtime &runtime, int limit) {
+  // --check must run every job for itself
+  if (imp->check || limit <= 0) return;
+  // Which resources a prior job claimed is not recorded, so it could not hold them while running early
+  if (!imp->resources.empty()) {
+    status_write(STREAM_LOG, "wake: not speculating, because jobs may claim declared resources\n");
+    return;
+  }
+  deep_unlink(AT_FDCWD, SPECULATE_DIR);
+
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) return;
+
+  std::vector<PriorJob> priors = imp->db->prior_jobs();
+  for (auto &prior : priors) {
+    if ((int)imp->speculations.size() == limit) break;
+
+    // Nothing confines a job to its scratch directory, so it must not name the workspace itself
+    if (!prior.stdin_file.empty() || !contained(prior.directory)) continue;
+    if (prior.commandline.find(cwd) != std::string::npos) continue;
+    if (prior.environment.find(cwd) != std::string::npos) continue;
+
+    // If the outputs are all still there, the job will simply be reused
+    std::vector<std::string> outputs;
+    bool safe = true, useful = false;
+    for (auto &output : imp->db->get_tree(2, prior.job)) {
+      safe = safe && contained(output.path);
+      useful = useful || access(output.path.c_str(), F_OK) != 0;
+      outputs.push_back(output.path);
+    }
+    if (!safe || !useful) continue;
+
+    // Inputs must be unchanged since they were hashed, and not rewritten by the job
+    std::set<std::string> wrote(outputs.begin(), outputs.end());
+    std::vector<FileReflection> inputs = imp->db->get_tree(1, prior.job);
+    std::vector<std::string> paths;
+    for (auto &input : inputs) {
+      safe = safe && contained(input.path) && wrote.find(input.path) == wrote.end()
+        && imp->db->get_hash(input.path, getmtime_ns(input.path.c_str())) == input.hash;
+      paths.push_back(input.path);
+    }
+    if (!safe) continue;
+
+    Scratch scratch;
+    std::string why;
+    if (!scratch.create(SPECULATE_DIR "/" + std::to_string(prior.job), paths, prior.directory, why)) {
+      status_write(STREAM_LOG, "wake: could not speculate job " + std::to_string(prior.job) + ": " + why + "\n");
+      scratch.remove();
+      continue;
+    }
+    std::string dir = prior.directory == "." ? scratch.root : scratch.root + "/" + prior.directory;
+
+    // Speculation is quiet; if adopted, the job is reported as if it had been reused
+    runtime.heap.guarantee(Job::reserve()
+      + String::reserve(prior.label.size())
+      + String::reserve(prior.directory.size())
+      + String::reserve(prior.stdin_file.size())
+      + String::reserve(prior.environment.size())
+      + String::reserve(prior.commandline.size()));
+    Job *job = Job::claim(runtime.heap, imp->db,
+      String::claim(runtime.heap, prior.label),
+      String::claim(runtime.heap, prior.directory),
+      String::claim(runtime.heap, prior.stdin_file),
+      String::claim(runtime.heap, prior.environment),
+      String::claim(runtime.heap, prior.commandline),
+      true, STREAM_LOG, STREAM_LOG, STREAM_LOG);
+    job->record = imp->db->predict_job(job->code.data[0], &job->pathtime);
+    job->predict = job->record;
+    imp->db->insert_job(
+      prior.directory,
+      prior.commandline,
+      prior.environment,
+      prior.stdin_file,
+      prior.signature,
+      prior.label,
+      prior.stack,
+      null_join(inputs),
+      &job->job);
+
+    imp->speculations.emplace_back(std::move(prior), runtime.heap.root(job), runtime.heap.root<Job>(nullptr));
+    Speculation &s = imp->speculations.back();
+    s.inputs = std::move(inputs);
+    s.outputs = std::move(outputs);
+    s.scratch = std::move(scratch);
+
+    Task *task = new Task(runtime.heap.root(job), dir, "", s.prior.environment, s.prior.commandline, ResourceClaims());
+    task->speculation = &s;
+    task->speculative = true;
+    queue_task(imp.get(), task);
+    imp->speculated = true;
+  }
+}
+
+// Return a job's claim on a resource, and requeue the tasks which were waiting for it
+static void release_claim(JobTable::detail *imp, Resource *resource, long count) {
+  resource->active -= count;
+  for (auto &task : resource->waiting) {
+    imp->pending.emplace_back(std::move(task));
+    std::push_heap(imp->pending.begin(), imp->pending.end());
+  }
+  resource->waiting.clear();
+}
+
 struct CompletedJobEntry {
   JobTable *jobtable;
   CompletedJobEntry(JobTable *jobtable_) : jobtable(jobtable_) { }
 
   bool operator () (const JobEntry &i) {
-    if (i.pid == 0 && i.pipe_stdout == -1 && i.pipe_stderr == -1) {
+    if (i.pid == 0 && !i.forking && i.pipe_stdout == -1 && i.pipe_stderr == -1) {
       status_state.jobs.erase(i.status);
       jobtable->imp->active -= i.job->threads();
       jobtable->imp->phys_active -= i.job->memory();
-      if (jobtable->imp->batch) {
+      for (auto &c : i.claims) release_claim(jobtable->imp.get(), c.first, c.second);
+      if (jobtable->imp->batch && i.replay_bytes <= i.replay_limit) {
+        i.write_replay();
+      } else if (jobtable->imp->batch) {
         if (!i.echo_line.empty())
           status_write(i.job->echo.c_str(), i.echo_line.c_str(), i.echo_line.size());
         jobtable->imp->db->replay_output(
@@ -678,31 +1710,234 @@ struct CompletedJobEntry {
   }
 };
 
+static void touch(std::vector<std::list<JobEntry>::iterator> &touched, std::list<JobEntry>::iterator entry) {
+  if (std::find(touched.begin(), touched.end(), entry) == touched.end())
+    touched.push_back(entry);
+}
+
+// Additive increase, multiplicative decrease of the job limit, as in TCP congestion control.
+// Returns true if the limit was raised (so more jobs may be launched).
+static bool adapt(JobTable::detail *imp, struct timeval now) {
+  double dwall = (now.tv_sec - imp->adapted.tv_sec) + (now.tv_usec - imp->adapted.tv_usec) / 1000000.0;
+  if (dwall < ADAPT_INTERVAL) return false;
+  imp->adapted = now;
+
+  SystemLoad load = get_system_load();
+  double cpus = std::thread::hardware_concurrency();
+  double perload = load.loadavg / cpus;
+  bool psi = load.cpu_some >= 0;
+
+  std::stringstream why;
+  if (psi && load.cpu_some > CPU_PRESSURE_HIGH) {
+    why << "cpu pressure " << load.cpu_some << "%";
+  } else if (load.mem_some > MEM_PRESSURE_HIGH) {
+    why << "memory pressure " << load.mem_some << "%";
+  } else if (load.io_some > IO_PRESSURE_HIGH) {
+    why << "io pressure " << load.io_some << "%";
+  } else if (!psi && perload > LOAD_HIGH) {
+    why << "load average " << load.loadavg;
+  }
+
+  double limit = imp->limit;
+  std::string reason = why.str();
+  if (!reason.empty()) {
+    limit = std::max(std::min(1.0, imp->ceiling), limit * ADAPT_BACKOFF);
+  } else if (psi
+      ? load.cpu_some < CPU_PRESSURE_LOW && load.mem_some < MEM_PRESSURE_LOW && load.io_some < IO_PRESSURE_LOW
+      : load.loadavg >= 0 && perload < LOAD_LOW) {
+    limit = std::min(imp->ceiling, limit + 1.0);
+    reason = "system is idle";
+  }
+
+  if (limit == imp->limit) return false;
+  bool raised = limit > imp->limit;
+  imp->limit = limit;
+
+  std::stringstream s;
+  s << "Job limit " << (raised ? "raised" : "lowered") << " to " << limit << " CPUs (" << reason << ")" << std::endl;
+  status_write(STREAM_INFO, s.str());
+
+  if (imp->profile) {
+    double time = (now.tv_sec - imp->epoch.tv_sec) + (now.tv_usec - imp->epoch.tv_usec) / 1000000.0;
+    imp->profile->limits.emplace_back(time, limit, reason);
+  }
+
+  return raised;
+}
+
+// Jobs which can least afford to wait are paused last and resumed first
+static bool more_urgent(const JobEntry &x, const JobEntry &y) {
+  if (x.priority != y.priority) return x.priority > y.priority;
+  return x.job->pathtime > y.job->pathtime;
+}
+
+// When memory is short, pause the least urgent job (unless it is the only one running).
+// Once memory frees up, resume the most urgent paused job.  One job changes per interval.
+// Returns true if no job remains paused (so more jobs may be launched).
+static bool relieve_memory(JobTable::detail *imp, struct timeval now) {
+  double dwall = (now.tv_sec - imp->measured.tv_sec) + (now.tv_usec - imp->measured.tv_usec) / 1000000.0;
+  if (dwall < MEMORY_INTERVAL) return false;
+  imp->measured = now;
+
+  bool cgroups = imp->cgroups.enabled();
+  if (!cgroups) imp->procs.scan();
+
+  uint64_t used = 0;
+  JobEntry *least = nullptr, *most = nullptr;
+  int unpaused = 0;
+  for (auto &i : imp->running) {
+    if (i.pid == 0) continue;
+    i.rss = cgroups ? imp->cgroups.memory(i.job->job) : imp->procs.tree_rss(i.pid);
+    used += i.rss;
+    if (i.paused) {
+      if (!most || more_urgent(i, *most)) most = &i;
+    } else {
+      ++unpaused;
+      if (!least || more_urgent(*least, i)) least = &i;
+    }
+  }
+
+  uint64_t available = get_available_memory();
+  uint64_t margin = imp->phys_total * (MEMORY_AMPLE - MEMORY_SHORT);
+  bool scarce = used > imp->phys_limit || (available && available < imp->phys_total * MEMORY_SHORT);
+  bool ample = used + margin < imp->phys_limit && (!available || available > imp->phys_total * MEMORY_AMPLE);
+
+  std::stringstream s;
+  if (scarce && unpaused > 1) {
+    pause_job(imp, *least, true);
+    s << "Paused job " << least->job->job << " (" << (least->rss >> 20) << " MiB) because memory is short";
+  } else if (most && (ample || unpaused == 0)) {
+    // A paused job is resumed regardless once nothing else runs, so the build always progresses
+    pause_job(imp, *most, false);
+    s << "Resumed job " << most->job->job << " (" << (most->rss >> 20) << " MiB)";
+  } else {
+    return false;
+  }
+
+  s << "; jobs use " << (used >> 20) << " MiB";
+  if (available) s << ", " << (available >> 20) << " MiB available";
+  s << std::endl;
+  status_write(STREAM_INFO, s.str());
+
+  return imp->paused == 0;
+}
+
+static size_t reserve_tree(const std::vector<FileReflection> &files) {
+  size_t need = reserve_list(files.size());
+  for (auto &i : files)
+    need += reserve_tuple2()
+            + String::reserve(i.path.size())
+            + String::reserve(i.hash.size());
+  return need;
+}
+
+static Value *claim_tree(Heap &h, const std::vector<FileReflection> &files) {
+  std::vector<Value*> vals;
+  vals.reserve(files.size());
+  for (auto &i : files)
+    vals.emplace_back(claim_tuple2(h,
+      String::claim(h, i.path),
+      String::claim(h, i.hash)));
+  return claim_list(h, vals.size(), vals.data());
+}
+
+// Answer every queued job_cache lookup with one batch of database queries
+static void resolve_probes(JobTable::detail *imp, Runtime &runtime) {
+  std::vector<Probe> probes;
+  probes.swap(imp->probes);
+
+  std::vector<CacheProbe> keys(probes.size());
+  for (size_t i = 0; i < probes.size(); ++i) {
+    Probe &probe = probes[i];
+    CacheProbe &key = keys[i];
+    key.directory    = probe.dir->as_str();
+    key.environment  = probe.env->as_str();
+    key.commandline  = probe.cmd->as_str();
+    key.stdin_file   = probe.stdin_file->as_str();
+    key.signature    = probe.signature;
+    key.visible      = probe.visible->c_str();
+    key.visible_size = probe.visible->size();
+  }
+
+  // Nothing is allocated until this returns, so the visible strings stay put
+  imp->db->reuse_jobs(keys, imp->check);
+
+  for (size_t i = 0; i < probes.size(); ++i) {
+    Probe &probe = probes[i];
+    CacheProbe &key = keys[i];
+
+    size_t need = reserve_tuple2() + reserve_tree(key.files) + reserve_list(1) + Job::reserve() + WJob::reserve();
+    runtime.heap.guarantee(need);
+
+    Value *joblist;
+    Job *adopted = nullptr;
+    if (!key.usage.found && !imp->check && !imp->speculations.empty())
+      adopted = adopt(imp, runtime, probe.dir.get(), probe.stdin_file.get(), probe.env.get(), probe.cmd.get(), probe.signature, probe.visible->as_str(), probe.res->as_str(), probe.priority);
+
+    if (adopted) {
+      Value *obj = adopted;
+      joblist = claim_list(runtime.heap, 1, &obj);
+    } else if (key.usage.found && !imp->check) {
+      Job *jobp = Job::claim(runtime.heap, imp->db, probe.dir.get(), probe.dir.get(), probe.stdin_file.get(), probe.env.get(), probe.cmd.get(), true, STREAM_ECHO, STREAM_INFO, STREAM_WARNING);
+      jobp->state = STATE_FORKED|STATE_STDOUT|STATE_STDERR|STATE_MERGED|STATE_FINISHED;
+      jobp->job = key.job;
+      jobp->record = key.usage;
+      // predict + reality unusued since Job not run
+      jobp->report = key.usage;
+      jobp->reality = key.usage;
+      jobp->pathtime = key.pathtime;
+
+      Value *obj = jobp;
+      joblist = claim_list(runtime.heap, 1, &obj);
+
+      // Even though this job is not run, it might have been the 'next' job of something that DID run
+      double pathtime = key.pathtime;
+      if (pathtime >= status_state.remain && pathtime*ALMOST_ONE*ALMOST_ONE <= status_state.remain) {
+        auto crit = imp->critJob(ALMOST_ONE * (pathtime - key.usage.runtime));
+#ifdef DEBUG_PROGRESS
+        std::cerr << "DECREASE CRIT: "
+          << status_state.remain << " => " << crit.pathtime << "  /  "
+          << status_state.total  << " => " << (status_state.total - status_state.remain - crit.pathtime) << std::endl;
+#endif
+        status_state.total = crit.pathtime + (status_state.total - status_state.remain);
+        status_state.remain = crit.pathtime;
+        status_state.current = crit.runtime;
+        if (crit.runtime == 0) gettimeofday(&imp->wall, 0);
+      }
+    } else {
+      joblist = claim_list(runtime.heap, 0, nullptr);
+    }
+
+    probe.output->resume(runtime, claim_tuple2(runtime.heap, joblist, claim_tree(runtime.heap, key.files)));
+  }
+}
+
 bool JobTable::wait(Runtime &runtime) {
-  char buffer[4096];
+  if (imp->buffer.size() != imp->log.read_size) imp->buffer.resize(imp->log.read_size);
+  char *buffer = imp->buffer.data();
   struct timespec nowait;
   memset(&nowait, 0, sizeof(nowait));
 
-  launch(this);
+  struct timeval enter, polled;
+  double idle = 0;
+  if (imp->stats) gettimeofday(&enter, 0);
 
-  bool compute = false;
-  while (!exit_now() && !imp->running.empty()) {
-    fd_set set;
-    int nfds = 0;
+  // Lookups made while the interpreter ran are answered before anything else
+  if (!imp->probes.empty()) {
+    resolve_probes(imp.get(), runtime);
+    return true;
+  }
 
-    FD_ZERO(&set);
-    for (auto &i : imp->running) {
-      if (i.pipe_stdout != -1) {
-        if (i.pipe_stdout >= nfds) nfds = i.pipe_stdout + 1;
-        FD_SET(i.pipe_stdout, &set);
-      }
-      if (i.pipe_stderr != -1) {
-        if (i.pipe_stderr >= nfds) nfds = i.pipe_stderr + 1;
-        FD_SET(i.pipe_stderr, &set);
-      }
-    }
+  // Once only speculation remains, nothing is left which could request it
+  if (imp->speculated && only_speculating(imp.get()))
+    while (!imp->speculations.empty())
+      discard(imp.get(), imp->speculations.begin());
 
-    // Block all signals we expect to interrupt pselect
+  launch(this);
+
+  bool compute = false;
+  while (!exit_now() && !imp->running.empty() && !(imp->speculated && only_speculating(imp.get()))) {
+    // Block all signals we expect to interrupt poll.wait()
     sigset_t saved;
     sigprocmask(SIG_BLOCK, &imp->block, &saved);
     sigdelset(&saved, SIGCHLD);
@@ -710,6 +1945,7 @@ bool JobTable::wait(Runtime &runtime) {
     // Check for all signals that are now blocked
     struct timespec *timeout = 0;
     if (child_ready) timeout = &nowait;
+    if (imp->launcher.pending()) timeout = &nowait;
     if (exit_now()) timeout = &nowait;
 
 #if !defined(__linux__)
@@ -727,86 +1963,114 @@ bool JobTable::wait(Runtime &runtime) {
 #endif
     status_refresh(true);
 
-    // Wait for a status change, with signals atomically unblocked in pselect
-    int retval = pselect(nfds, &set, 0, 0, timeout, &saved);
+    // Jobs held back by --adaptive must not wait for an unrelated event
+    struct timespec resample;
+    if (!timeout && imp->adaptive && !imp->pending.empty()) {
+      resample.tv_sec = ADAPT_INTERVAL;
+      resample.tv_nsec = 0;
+      timeout = &resample;
+    }
+
+    // Memory use must be watched even if nothing happens
+    struct timespec measure;
+    if (!timeout && imp->memory_pause) {
+      measure.tv_sec = MEMORY_INTERVAL;
+      measure.tv_nsec = 0;
+      timeout = &measure;
+    }
+
+    // Wait for a status change, with signals atomically unblocked while waiting
+    if (imp->stats) gettimeofday(&polled, 0);
+    std::vector<int> ready = imp->poll.wait(timeout, &saved);
 
     // Restore signal mask
     sigaddset(&saved, SIGCHLD);
     sigprocmask(SIG_SETMASK, &saved, 0);
 
-    if (retval == -1 && errno != EINTR) {
-      perror("pselect");
-      exit(1);
-    }
-
     struct timeval now;
     gettimeofday(&now, 0);
+    if (imp->stats) idle += (now.tv_sec - polled.tv_sec) + (now.tv_usec - polled.tv_usec) / 1000000.0;
+
+    if (imp->adaptive && adapt(imp.get(), now))
+      launch(this);
+
+    if (imp->memory_pause && relieve_memory(imp.get(), now))
+      launch(this);
 
     int done = 0;
+    std::vector<std::list<JobEntry>::iterator> touched; // entries which might now be complete
 
-    if (retval > 0) for (auto &i : imp->running) {
-      if (i.pipe_stdout != -1 && FD_ISSET(i.pipe_stdout, &set)) {
-        int got = read(i.pipe_stdout, buffer, sizeof(buffer));
+    for (int fd : ready) {
+      if (fd == imp->launcher.fd()) {
+        if (!imp->launcher.receive()) {
+          std::cerr << "wake job launcher exited unexpectedly" << std::endl;
+          exit(1);
+        }
+        continue;
+      }
+      auto owner = imp->pipes.find(fd);
+      if (owner == imp->pipes.end()) continue;
+      auto entry = owner->second;
+      JobEntry &i = *entry;
+      if (fd == i.pipe_stdout) {
+        int got = read(i.pipe_stdout, buffer, imp->buffer.size());
         if (got == 0 || (got < 0 && errno != EINTR)) {
+          imp->pipes.erase(owner);
+          imp->poll.remove(i.pipe_stdout);
           close(i.pipe_stdout);
+          i.flush_output();
+          i.finish_spill(1);
           i.pipe_stdout = -1;
           i.status->wait_stdout = false;
           i.job->state |= STATE_STDOUT;
           runtime.heap.guarantee(WJob::reserve());
           runtime.schedule(WJob::claim(runtime.heap, i.job.get()));
+          touch(touched, entry);
           ++done;
-          if (!imp->batch && !i.stdout_buf.empty()) {
-            if (i.stdout_buf.back() != '\n') i.stdout_buf.push_back('\n');
-            status_write(i.job->stream_out.c_str(), i.stdout_buf.data(), i.stdout_buf.size());
-            i.stdout_buf.clear();
-          }
-        } else {
-          i.job->db->save_output(i.job->job, 1, buffer, got, i.runtime(now));
-          if (!imp->batch) {
-            i.stdout_buf.append(buffer, got);
-            size_t dump = i.stdout_buf.rfind('\n');
-            if (dump != std::string::npos) {
-              status_write(i.job->stream_out.c_str(), i.stdout_buf.data(), dump+1);
-              i.stdout_buf.erase(0, dump+1);
-            }
-          }
+          if (!imp->batch) i.stdout_lines.finish(i.job->stream_out.c_str());
+        } else if (got > 0) {
+          i.save_output(1, buffer, got, i.runtime(now));
+          if (!imp->batch) i.stdout_lines.feed(i.job->stream_out.c_str(), buffer, got);
         }
       }
-      if (i.pipe_stderr != -1 && FD_ISSET(i.pipe_stderr, &set)) {
-        int got = read(i.pipe_stderr, buffer, sizeof(buffer));
+      if (fd == i.pipe_stderr) {
+        int got = read(i.pipe_stderr, buffer, imp->buffer.size());
         if (got == 0 || (got < 0 && errno != EINTR)) {
+          imp->pipes.erase(owner);
+          imp->poll.remove(i.pipe_stderr);
           close(i.pipe_stderr);
+          i.flush_output();
+          i.finish_spill(2);
           i.pipe_stderr = -1;
           i.status->wait_stderr = false;
           i.job->state |= STATE_STDERR;
           runtime.heap.guarantee(WJob::reserve());
           runtime.schedule(WJob::claim(runtime.heap, i.job.get()));
+          touch(touched, entry);
           ++done;
-          if (!imp->batch && !i.stderr_buf.empty()) {
-            if (i.stderr_buf.back() != '\n') i.stderr_buf.push_back('\n');
-            status_write(i.job->stream_err.c_str(), i.stderr_buf.data(), i.stderr_buf.size());
-            i.stderr_buf.clear();
-          }
-        } else {
-          i.job->db->save_output(i.job->job, 2, buffer, got, i.runtime(now));
-          if (!imp->batch) {
-            i.stderr_buf.append(buffer, got);
-            size_t dump = i.stderr_buf.rfind('\n');
-            if (dump != std::string::npos) {
-              status_write(i.job->stream_err.c_str(), i.stderr_buf.data(), dump+1);
-              i.stderr_buf.erase(0, dump+1);
-            }
-          }
+          if (!imp->batch) i.stderr_lines.finish(i.job->stream_err.c_str());
+        } else if (got > 0) {
+          i.save_output(2, buffer, got, i.runtime(now));
+          if (!imp->batch) i.stderr_lines.feed(i.job->stream_err.c_str(), buffer, got);
         }
       }
     }
 
+    // Exits are only recognized once the launcher has reported the pid
+    record_spawned(imp.get(), false);
+
     int status;
     pid_t pid;
+    RUsage childUsage;
     child_ready = false;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    while ((pid = reapChild(&status, &childUsage)) > 0 || (pid = imp->launcher.reap(&status, &childUsage)) > 0) {
       if (WIFSTOPPED(status)) continue;
 
+      auto owner = imp->pids.find(pid);
+      if (owner == imp->pids.end()) continue;
+      auto entry = owner->second;
+      imp->pids.erase(owner);
+
       ++done;
       int code = 0;
       if (WIFEXITED(status)) {
@@ -815,38 +2079,36 @@ bool JobTable::wait(Runtime &runtime) {
         code = -WTERMSIG(status);
       }
 
-      RUsage totalUsage = getRUsageChildren();
-      RUsage childUsage = totalUsage - imp->childrenUsage;
-      imp->childrenUsage = totalUsage;
-
-      for (auto &i : imp->running) {
-        if (i.pid == pid) {
-          i.pid = 0;
-          i.status->merged = true;
-          i.job->state |= STATE_MERGED;
-          i.job->reality.found    = true;
-          i.job->reality.status   = code;
-          i.job->reality.runtime  = i.runtime(now);
-          i.job->reality.cputime  = childUsage.utime + childUsage.stime;
-          i.job->reality.membytes = childUsage.membytes;
-          i.job->reality.ibytes   = childUsage.ibytes;
-          i.job->reality.obytes   = childUsage.obytes;
-          runtime.heap.guarantee(WJob::reserve());
-          runtime.schedule(WJob::claim(runtime.heap, i.job.get()));
-
-          // If this was the job on the critical path, adjust remain
-          if (i.job->pathtime == status_state.remain) {
-            auto crit = imp->critJob(ALMOST_ONE * (i.job->pathtime - i.job->record.runtime));
+      JobEntry &i = *entry;
+      pause_job(imp.get(), i, false); // other processes of the job may remain
+      i.pid = 0;
+      imp->last = now;
+      imp->critical.erase(i.critical);
+      i.status->merged = true;
+      i.job->state |= STATE_MERGED;
+      i.job->reality.found    = true;
+      i.job->reality.status   = code;
+      i.job->reality.runtime  = i.runtime(now);
+      i.job->reality.cputime  = childUsage.utime + childUsage.stime;
+      i.job->reality.membytes = childUsage.membytes;
+      i.job->reality.ibytes   = childUsage.ibytes;
+      i.job->reality.obytes   = childUsage.obytes;
+      if (imp->cgroups.enabled()) imp->cgroups.collect(i.job->job, i.job->reality);
+      runtime.heap.guarantee(WJob::reserve());
+      runtime.schedule(WJob::claim(runtime.heap, i.job.get()));
+      touch(touched, entry);
+
+      // If this was the job on the critical path, adjust remain
+      if (i.job->pathtime == status_state.remain) {
+        auto crit = imp->critJob(ALMOST_ONE * (i.job->pathtime - i.job->record.runtime));
 #ifdef DEBUG_PROGRESS
-            std::cerr << "RUN DONE CRIT: "
-              << status_state.remain << " => " << crit.pathtime << "  /  "
-              << status_state.total << std::endl;
+        std::cerr << "RUN DONE CRIT: "
+          << status_state.remain << " => " << crit.pathtime << "  /  "
+          << status_state.total << std::endl;
 #endif
-            status_state.remain = crit.pathtime;
-            status_state.current = crit.runtime;
-            if (crit.runtime == 0) imp->wall = now;
-          }
-        }
+        status_state.remain = crit.pathtime;
+        status_state.current = crit.runtime;
+        if (crit.runtime == 0) imp->wall = now;
       }
     }
 
@@ -861,8 +2123,19 @@ bool JobTable::wait(Runtime &runtime) {
       }
     }
 
+    // Only entries which changed state this round can have completed
     CompletedJobEntry pred(this);
-    imp->running.remove_if(pred);
+    std::vector<Speculation*> speculations;
+    for (auto entry : touched) {
+      if (pred(*entry)) {
+        if (entry->speculation) speculations.push_back(entry->speculation);
+        Job *job = entry->job.get(); // still on the heap; nothing is allocated before it is used
+        imp->running.erase(entry);
+        if (imp->telemetry) telemetry(imp.get(), "finished", job);
+      }
+    }
+    for (auto spec : speculations)
+      completed(imp.get(), runtime, spec);
 
     if (done > 0) {
       compute = true;
@@ -870,6 +2143,12 @@ bool JobTable::wait(Runtime &runtime) {
     }
   }
 
+  if (imp->stats) {
+    struct timeval leave;
+    gettimeofday(&leave, 0);
+    imp->busy += (leave.tv_sec - enter.tv_sec) + (leave.tv_usec - enter.tv_usec) / 1000000.0 - idle;
+  }
+
   return compute;
 }
 
@@ -961,32 +2240,38 @@ static PRIMFN(prim_job_fail_finish) {
 }
 
 static PRIMTYPE(type_job_launch) {
-  return args.size() == 11 &&
+  return args.size() == 13 &&
     args[0]->unify(Job::typeVar) &&
     args[1]->unify(String::typeVar) &&
     args[2]->unify(String::typeVar) &&
     args[3]->unify(String::typeVar) &&
     args[4]->unify(String::typeVar) &&
-    args[5]->unify(Integer::typeVar) &&
-    args[6]->unify(Double::typeVar) &&
-    args[7]->unify(Double::typeVar) &&
-    args[8]->unify(Integer::typeVar) &&
-    args[9]->unify(Integer::typeVar) &&
+    args[5]->unify(String::typeVar) &&
+    args[6]->unify(Integer::typeVar) &&
+    args[7]->unify(Integer::typeVar) &&
+    args[8]->unify(Double::typeVar) &&
+    args[9]->unify(Double::typeVar) &&
     args[10]->unify(Integer::typeVar) &&
+    args[11]->unify(Integer::typeVar) &&
+    args[12]->unify(Integer::typeVar) &&
     out->unify(Data::typeUnit);
 }
 
 static PRIMFN(prim_job_launch) {
   JobTable *jobtable = static_cast<JobTable*>(data);
-  EXPECT(11);
+  EXPECT(13);
   JOB(job, 0);
   STRING(dir, 1);
   STRING(stdin_file, 2);
   STRING(env, 3);
   STRING(cmd, 4);
+  STRING(res, 5);
+  INTEGER_MPZ(priority, 6);
+
+  REQUIRE (mpz_fits_slong_p(priority));
 
   runtime.heap.reserve(reserve_unit());
-  parse_usage(&job->predict, args+5, runtime, scope);
+  parse_usage(&job->predict, args+7, runtime, scope);
   job->predict.found = true;
 
   REQUIRE (job->state == 0);
@@ -997,8 +2282,13 @@ static PRIMFN(prim_job_launch) {
     dir->as_str(),
     stdin_file->as_str(),
     env->as_str(),
-    cmd->as_str()));
+    cmd->as_str(),
+    parse_claims(jobtable->imp.get(), res->as_str())));
+  heap.back()->priority = mpz_get_si(priority);
+  heap.back()->critical = jobtable->imp->critical.emplace(job->pathtime, job->record.runtime);
+  if (jobtable->imp->stats) gettimeofday(&heap.back()->ready, 0);
   std::push_heap(heap.begin(), heap.end());
+  if (jobtable->imp->telemetry) telemetry(jobtable->imp.get(), "queued", job);
 
   // If a scheduled job claims a longer critical path, we need to adjust the total path time
   if (job->pathtime >= status_state.remain) {
@@ -1140,25 +2430,6 @@ static PRIMFN(prim_job_create) {
   RETURN(out);
 }
 
-static size_t reserve_tree(const std::vector<FileReflection> &files) {
-  size_t need = reserve_list(files.size());
-  for (auto &i : files)
-    need += reserve_tuple2()
-            + String::reserve(i.path.size())
-            + String::reserve(i.hash.size());
-  return need;
-}
-
-static Value *claim_tree(Heap &h, const std::vector<FileReflection> &files) {
-  std::vector<Value*> vals;
-  vals.reserve(files.size());
-  for (auto &i : files)
-    vals.emplace_back(claim_tuple2(h,
-      String::claim(h, i.path),
-      String::claim(h, i.hash)));
-  return claim_list(h, vals.size(), vals.data());
-}
-
 static PRIMTYPE(type_job_cache) {
   TypeVar spair;
   TypeVar plist;
@@ -1174,81 +2445,40 @@ static PRIMTYPE(type_job_cache) {
   jlist[0].unify(Job::typeVar);
   pair[0].unify(jlist);
   pair[1].unify(plist);
-  return args.size() == 6 &&
+  return args.size() == 8 &&
     args[0]->unify(String::typeVar) &&
     args[1]->unify(String::typeVar) &&
     args[2]->unify(String::typeVar) &&
     args[3]->unify(String::typeVar) &&
     args[4]->unify(Integer::typeVar) &&
     args[5]->unify(String::typeVar) &&
+    args[6]->unify(String::typeVar) &&
+    args[7]->unify(Integer::typeVar) &&
     out->unify(pair);
 }
 
 static PRIMFN(prim_job_cache) {
   JobTable *jobtable = static_cast<JobTable*>(data);
-  EXPECT(6);
+  EXPECT(8);
   STRING(dir, 0);
   STRING(stdin_file, 1);
   STRING(env, 2);
   STRING(cmd, 3);
   INTEGER_MPZ(signature, 4);
   STRING(visible, 5);
+  STRING(res, 6);
+  INTEGER_MPZ(priority, 7);
 
   Hash hash;
   REQUIRE(mpz_sizeinbase(signature, 2) <= 8*sizeof(hash.data));
+  REQUIRE(mpz_fits_slong_p(priority));
   mpz_export(&hash.data[0], 0, 1, sizeof(hash.data[0]), 0, 0, signature);
 
-  // This function can be rerun; it's side effect has no impact on re-execution of reuse_job.
-  long job;
-  double pathtime;
-  std::vector<FileReflection> files;
-  Usage reuse = jobtable->imp->db->reuse_job(
-    dir->as_str(),
-    env->as_str(),
-    cmd->as_str(),
-    stdin_file->as_str(),
-    hash.data[0],
-    visible->as_str(),
-    jobtable->imp->check,
-    job,
-    files,
-    &pathtime);
-
-  size_t need = reserve_tuple2() + reserve_tree(files) + reserve_list(1) + Job::reserve();
-  runtime.heap.reserve(need);
-
-  Value *joblist;
-  if (reuse.found && !jobtable->imp->check) {
-    Job *jobp = Job::claim(runtime.heap, jobtable->imp->db, dir, dir, stdin_file, env, cmd, true, STREAM_ECHO, STREAM_INFO, STREAM_WARNING);
-    jobp->state = STATE_FORKED|STATE_STDOUT|STATE_STDERR|STATE_MERGED|STATE_FINISHED;
-    jobp->job = job;
-    jobp->record = reuse;
-    // predict + reality unusued since Job not run
-    jobp->report = reuse;
-    jobp->reality = reuse;
-    jobp->pathtime = pathtime;
-
-    Value *obj = jobp;
-    joblist = claim_list(runtime.heap, 1, &obj);
-
-    // Even though this job is not run, it might have been the 'next' job of something that DID run
-    if (pathtime >= status_state.remain && pathtime*ALMOST_ONE*ALMOST_ONE <= status_state.remain) {
-      auto crit = jobtable->imp->critJob(ALMOST_ONE * (pathtime - reuse.runtime));
-#ifdef DEBUG_PROGRESS
-      std::cerr << "DECREASE CRIT: "
-        << status_state.remain << " => " << crit.pathtime << "  /  "
-        << status_state.total  << " => " << (status_state.total - status_state.remain - crit.pathtime) << std::endl;
-#endif
-      status_state.total = crit.pathtime + (status_state.total - status_state.remain);
-      status_state.remain = crit.pathtime;
-      status_state.current = crit.runtime;
-      if (crit.runtime == 0) gettimeofday(&jobtable->imp->wall, 0);
-    }
-  } else {
-    joblist = claim_list(runtime.heap, 0, nullptr);
-  }
+  runtime.heap.reserve(Tuple::fulfiller_pads);
+  Continuation *continuation = scope->claim_fulfiller(runtime, output);
 
-  RETURN(claim_tuple2(runtime.heap, joblist, claim_tree(runtime.heap, files)));
+  // Answered by resolve_probes, once the interpreter has nothing else to do
+  jobtable->imp->probes.emplace_back(runtime.heap, dir, stdin_file, env, cmd, visible, res, continuation, hash.data[0], mpz_get_si(priority));
 }
 
 static size_t reserve_usage(const Usage &usage) {
@@ -1333,7 +2563,7 @@ static PRIMFN(prim_job_kill) {
 
   if (mpz_cmp_si(arg1, 256) < 0 && mpz_cmp_si(arg1, 0) > 0) {
     int sig = mpz_get_si(arg1);
-    if ((arg0->state & STATE_FORKED) && !(arg0->state & STATE_MERGED))
+    if ((arg0->state & STATE_FORKED) && !(arg0->state & STATE_MERGED) && arg0->pid != 0)
       kill(arg0->pid, sig);
   }
 
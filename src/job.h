@@ -18,18 +18,47 @@
 #ifndef JOB_H
 #define JOB_H
 
+#include <cstdint>
 #include <memory>
+#include <string>
 
 struct Database;
 struct Runtime;
+struct Profile;
 
 struct JobTable {
   struct detail;
   std::unique_ptr<detail> imp;
 
-  JobTable(Database *db, double percent, bool debug, bool verbose, bool quiet, bool check, bool batch);
+  JobTable(Database *db, double percent, bool debug, bool verbose, bool quiet, bool check, bool batch, bool adaptive, Profile *profile);
   ~JobTable();
 
+  // Allow at most 'limit' of the named resource to be held by running jobs
+  void add_resource(const std::string &name, long limit);
+
+  // Run each job in its own cgroup, for accounting and (optionally) memory limits
+  void use_cgroups(bool limit_memory);
+
+  // While memory is short, stop the least urgent running jobs (and launch no more)
+  void pause_on_memory();
+
+  // Read job output 'read_size' bytes at a time, saving it to the database
+  // once 'flush_bytes' have accumulated or the oldest is 'flush_seconds' old
+  // A zero size or negative delay keeps the default
+  void buffer_output(size_t read_size, uint64_t flush_bytes, double flush_seconds);
+
+  // Keep job output beyond 'limit' bytes per stream in content-addressed files under dir
+  void spill_output(uint64_t limit, const std::string &dir);
+
+  // Before evaluation, start up to 'limit' jobs from the last run whose inputs are unchanged.
+  // Each runs in a scratch directory; its result is adopted if the same job is requested.
+  // Nothing is started if resources were declared, as speculative jobs would not claim them.
+  void speculate(Runtime &runtime, int limit);
+
+  // Record launch latency and scheduler overhead, for report_stats()
+  void record_stats();
+  void report_stats();
+
   // Wait for a job to complete; false -> no more active jobs
   bool wait(Runtime &runtime);
   static bool exit_now();
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include <iostream>
+#include <deque>
+
+#include "launcher.h"
+#include "zygote.h"
+#include "rusage.h"
+#include "spawn.h"
+
+// How much to read from the launcher per system call
+#define EVENT_BUFFER_SIZE (64*1024)
+
+extern char **environ;
+
+struct Launcher::detail {
+  int sock;
+  bool ready;
+  std::string partial; // an incomplete event
+  std::deque<pid_t> spawned;
+  std::deque<zygote_event> exited;
+
+  detail() : sock(-1), ready(false) { }
+};
+
+Launcher::Launcher() : imp(new Launcher::detail) {
+}
+
+Launcher::~Launcher() {
+  if (imp->sock != -1) close(imp->sock);
+}
+
+// Returns 1 if events were read, 0 if none were available, and -1 if the launcher is gone
+static int fill(Launcher::detail *imp, bool block) {
+  static char buffer[EVENT_BUFFER_SIZE];
+
+  ssize_t got;
+  do got = recv(imp->sock, buffer, sizeof(buffer), block ? 0 : MSG_DONTWAIT);
+  while (got == -1 && errno == EINTR);
+
+  if (got == -1 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+  if (got <= 0) return -1;
+
+  imp->partial.append(buffer, got);
+  size_t done = 0;
+  for (; done + sizeof(zygote_event) <= imp->partial.size(); done += sizeof(zygote_event)) {
+    zygote_event ev;
+    memcpy(&ev, imp->partial.data() + done, sizeof(ev));
+    switch (ev.kind) {
+      case ZYGOTE_READY:   imp->ready = true; break;
+      case ZYGOTE_SPAWNED: imp->spawned.push_back(ev.pid); break;
+      case ZYGOTE_EXITED:  imp->exited.push_back(ev); break;
+    }
+  }
+  imp->partial.erase(0, done);
+
+  return 1;
+}
+
+bool Launcher::start(const std::string &shim, std::string &why) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    why = std::string("socketpair: ") + strerror(errno);
+    return false;
+  }
+
+  int flags;
+  if ((flags = fcntl(sv[0], F_GETFD, 0)) != -1) fcntl(sv[0], F_SETFD, flags | FD_CLOEXEC);
+
+  // The launcher's jobs inherit its signal mask; wake blocks SIGCHLD
+  std::string fd = std::to_string(sv[1]);
+  const char *argv[] = { shim.c_str(), "<zygote>", fd.c_str(), 0 };
+  sigset_t set, saved;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &set, &saved);
+  pid_t pid = wake_spawn(argv[0], const_cast<char**>(argv), environ);
+  sigprocmask(SIG_SETMASK, &saved, 0);
+  close(sv[1]);
+
+  imp->sock = sv[0];
+  while (pid != -1 && !imp->ready && fill(imp.get(), true) > 0) { }
+
+  if (!imp->ready) {
+    why = shim + " did not start as a job launcher";
+    close(imp->sock);
+    imp->sock = -1;
+    return false;
+  }
+
+  return true;
+}
+
+int Launcher::fd() const {
+  return imp->sock;
+}
+
+static int count_null(const std::string &str) {
+  int nulls = 0;
+  for (char c : str) nulls += (c == 0);
+  return nulls;
+}
+
+void Launcher::spawn(
+  const std::string &dir,
+  const std::string &stdin_file,
+  int stdout_fd,
+  int stderr_fd,
+  int cgroup_procs,
+  const std::string &cmdline,
+  const std::string &environ)
+{
+  zygote_request req;
+  req.fds   = cgroup_procs == -1 ? 2 : 3;
+  req.argc  = count_null(cmdline);
+  req.envc  = count_null(environ);
+  req.bytes = dir.size() + stdin_file.size() + 2 + cmdline.size() + environ.size();
+
+  std::string packet;
+  packet.reserve(sizeof(req) + req.bytes);
+  packet.append(reinterpret_cast<const char*>(&req), sizeof(req));
+  packet.append(dir.c_str(), dir.size() + 1);
+  packet.append(stdin_file.c_str(), stdin_file.size() + 1);
+  packet.append(cmdline);
+  packet.append(environ);
+
+  int fds[ZYGOTE_MAX_FDS] = { stdout_fd, stderr_fd, cgroup_procs };
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(packet.data());
+  iov.iov_len = packet.size();
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(req.fds * sizeof(int));
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(req.fds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, req.fds * sizeof(int));
+
+  // The launcher blocks if its events are not read, so never let them pile up
+  while (fill(imp.get(), false) > 0) { }
+
+  // The descriptors ride along with the first byte; a large request may need more writes
+  ssize_t got;
+  do got = sendmsg(imp->sock, &msg, 0);
+  while (got == -1 && errno == EINTR);
+  size_t done = got == -1 ? 0 : got;
+  while (got != -1 && done < packet.size()) {
+    got = write(imp->sock, packet.data() + done, packet.size() - done);
+    if (got > 0) done += got;
+    else if (got == -1 && errno == EINTR) got = 0;
+  }
+
+  if (got == -1) {
+    perror("wake job launcher send");
+    exit(1);
+  }
+}
+
+pid_t Launcher::spawned(bool block) {
+  while (block && imp->spawned.empty()) {
+    if (fill(imp.get(), true) < 0) {
+      std::cerr << "wake job launcher exited unexpectedly" << std::endl;
+      exit(1);
+    }
+  }
+
+  if (imp->spawned.empty()) return 0;
+  pid_t pid = imp->spawned.front();
+  imp->spawned.pop_front();
+  if (pid < 0) {
+    errno = -pid;
+    return -1;
+  }
+
+  return pid;
+}
+
+bool Launcher::receive() {
+  if (imp->sock == -1) return true;
+  int got;
+  while ((got = fill(imp.get(), false)) > 0) { }
+  return got == 0;
+}
+
+bool Launcher::pending() const {
+  return !imp->exited.empty();
+}
+
+pid_t Launcher::reap(int *status, RUsage *usage) {
+  if (imp->exited.empty()) return 0;
+  zygote_event &ev = imp->exited.front();
+  pid_t pid = ev.pid;
+  *status = ev.status;
+  *usage = convertRUsage(ev.usage);
+  imp->exited.pop_front();
+  return pid;
+}
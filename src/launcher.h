@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LAUNCHER_H
+#define LAUNCHER_H
+
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+
+struct RUsage;
+
+// A client for the job launcher (shim-wake <zygote>), a small helper process
+// started once, which forks and execs jobs on wake's behalf. Jobs are then
+// children of the launcher, so their exit status arrives over its socket.
+struct Launcher {
+  struct detail;
+  std::unique_ptr<detail> imp;
+
+  Launcher();
+  ~Launcher(); // the launcher exits when its socket is closed
+
+  // On failure, 'why' explains why jobs must be spawned directly instead
+  bool start(const std::string &shim, std::string &why);
+  // The socket, which is readable when events arrive (or -1 if not started)
+  int fd() const;
+
+  // Ask the launcher to run cmdline (null separated) in dir with stdio redirected.
+  // This does not wait for the fork; the job's pid is reported later by spawned().
+  void spawn(
+    const std::string &dir,
+    const std::string &stdin_file,
+    int stdout_fd,
+    int stderr_fd,
+    int cgroup_procs, // or -1
+    const std::string &cmdline,
+    const std::string &environ);
+
+  // Read whatever events are available without blocking; false if the launcher is gone
+  bool receive();
+  // The pid of the next job passed to spawn, in the order they were passed, or -1 with
+  // errno set if the launcher could not fork it. Returns 0 if it is not yet known,
+  // unless 'block' is set, in which case this waits for it.
+  pid_t spawned(bool block);
+  // True if an exited job is waiting to be reaped
+  bool pending() const;
+  // Like reapChild, for jobs started by the launcher
+  pid_t reap(int *status, RUsage *usage);
+};
+
+#endif
@@ -21,8 +21,10 @@
 
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <random>
 #include <set>
@@ -67,6 +69,16 @@ void print_help(const char *argv0) {
     << "    --no-wait        Do not wait to obtain database lock; fail immediately"      << std::endl
     << "    --no-workspace   Do not open a database or scan for sources files"           << std::endl
     << "    --fatal-warnings Do not execute if there are any warnings"                   << std::endl
+    << "    --resources LIST Limit jobs using resources, eg: license/vcs=4,io/disk=2"    << std::endl
+    << "    --adaptive       Adjust the job limit to system load and resource pressure"  << std::endl
+    << "    --cgroups  MODE  Run jobs in cgroups to 'account' or also 'limit' memory"    << std::endl
+    << "    --memory-pause   Pause the least urgent jobs while memory is short"          << std::endl
+    << "    --read-size SIZE Read job output SIZE (eg: 64K) bytes at a time"             << std::endl
+    << "    --log-flush SIZE Save job output to the database every SIZE (default 1M)"    << std::endl
+    << "    --log-delay SECS ... or once it has waited SECS seconds (default 1.0)"       << std::endl
+    << "    --spill    SIZE  Keep job output beyond SIZE (eg: 64M) per stream in files"  << std::endl
+    << "    --spill-dir DIR  Where --spill keeps job output (default .build/spill)"      << std::endl
+    << "    --speculate N    Start up to N unchanged jobs of the last build immediately" << std::endl
     << "    --heap-factor X  Heap-size is X * live data after the last GC (default 4.0)" << std::endl
     << "    --profile-heap   Report memory consumption on every garbage collection"      << std::endl
     << "    --profile  FILE  Report runtime breakdown by stack trace to HTML/JSON file"  << std::endl
@@ -92,7 +104,45 @@ void print_help(const char *argv0) {
     << "    --exports -e     Print symbols exported by the selected package (see --in)"  << std::endl
     << "    --help    -h     Print this help message and exit"                           << std::endl
     << std::endl;
-    // debug-db, no-optimize, stop-after-* are secret undocumented options
+    // debug-db, job-stats, no-optimize, stop-after-* are secret undocumented options
+}
+
+// Parse a byte count, with an optional K, M or G suffix
+static bool parse_size(const char *str, uint64_t &out) {
+  if (*str < '0' || *str > '9') return false;
+  char *tail;
+  out = strtoull(str, &tail, 10);
+  switch (*tail) {
+    case 'K': case 'k': out <<= 10; ++tail; break;
+    case 'M': case 'm': out <<= 20; ++tail; break;
+    case 'G': case 'g': out <<= 30; ++tail; break;
+  }
+  return *tail == 0 && out > 0;
+}
+
+typedef std::vector<std::pair<std::string, long> > ResourceLimits;
+
+// Parse "NAME=COUNT" entries separated by commas or whitespace; '#' starts a comment
+static bool parse_resources(const std::string &spec, ResourceLimits &out, std::string &bad) {
+  std::stringstream lines(spec);
+  std::string line;
+  while (std::getline(lines, line)) {
+    line.resize(std::min(line.size(), line.find('#')));
+    for (auto &c : line) if (c == ',') c = ' ';
+    std::stringstream words(line);
+    std::string word;
+    while (words >> word) {
+      size_t eq = word.find_last_of('=');
+      char *tail = 0;
+      long count = eq == std::string::npos ? 0 : strtol(word.c_str() + eq + 1, &tail, 10);
+      if (eq == 0 || count <= 0 || *tail) {
+        bad = word;
+        return false;
+      }
+      out.emplace_back(word.substr(0, eq), count);
+    }
+  }
+  return true;
 }
 
 int main(int argc, char **argv) {
@@ -106,6 +156,16 @@ int main(int argc, char **argv) {
     { 0,   "no-workspace",          GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "no-tty",                GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "fatal-warnings",        GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "resources",             GOPT_ARGUMENT_REQUIRED  },
+    { 0,   "adaptive",              GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "cgroups",               GOPT_ARGUMENT_REQUIRED  },
+    { 0,   "memory-pause",          GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "read-size",             GOPT_ARGUMENT_REQUIRED  },
+    { 0,   "log-flush",             GOPT_ARGUMENT_REQUIRED  },
+    { 0,   "log-delay",             GOPT_ARGUMENT_REQUIRED  },
+    { 0,   "spill",                 GOPT_ARGUMENT_REQUIRED  },
+    { 0,   "spill-dir",             GOPT_ARGUMENT_REQUIRED  },
+    { 0,   "speculate",             GOPT_ARGUMENT_REQUIRED  },
     { 0,   "heap-factor",           GOPT_ARGUMENT_REQUIRED  | GOPT_ARGUMENT_NO_HYPHEN },
     { 0,   "profile-heap",          GOPT_ARGUMENT_FORBIDDEN | GOPT_REPEATABLE },
     { 0,   "profile",               GOPT_ARGUMENT_REQUIRED  },
@@ -125,6 +185,7 @@ int main(int argc, char **argv) {
     { 0,   "html",                  GOPT_ARGUMENT_FORBIDDEN },
     { 'h', "help",                  GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "debug-db",              GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "job-stats",             GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "debug-target",          GOPT_ARGUMENT_REQUIRED  },
     { 0,   "stop-after-parse",      GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "stop-after-type-check", GOPT_ARGUMENT_FORBIDDEN },
@@ -152,6 +213,7 @@ int main(int argc, char **argv) {
   bool workspace=!arg(options, "no-workspace")->count;
   bool tty     =!arg(options, "no-tty"  )->count;
   bool fwarning= arg(options, "fatal-warnings")->count;
+  bool adaptive= arg(options, "adaptive")->count;
   int  profileh= arg(options, "profile-heap")->count;
   bool input   = arg(options, "input"   )->count;
   bool output  = arg(options, "output"  )->count;
@@ -163,6 +225,7 @@ int main(int argc, char **argv) {
   bool global  = arg(options, "globals" )->count;
   bool help    = arg(options, "help"    )->count;
   bool debugdb = arg(options, "debug-db")->count;
+  bool jobstats = arg(options, "job-stats")->count;
   bool parse   = arg(options, "stop-after-parse")->count;
   bool tcheck  = arg(options, "stop-after-type-check")->count;
   bool dumpssa = arg(options, "stop-after-ssa")->count;
@@ -171,6 +234,15 @@ int main(int argc, char **argv) {
 
   const char *percents= arg(options, "percent")->argument;
   const char *heapf   = arg(options, "heap-factor")->argument;
+  const char *rlimits = arg(options, "resources")->argument;
+  const char *cgroups = arg(options, "cgroups")->argument;
+  bool mempause = arg(options, "memory-pause")->count;
+  const char *readsize= arg(options, "read-size")->argument;
+  const char *logflush= arg(options, "log-flush")->argument;
+  const char *logdelay= arg(options, "log-delay")->argument;
+  const char *spill   = arg(options, "spill")->argument;
+  const char *spilldir= arg(options, "spill-dir")->argument;
+  const char *speculates = arg(options, "speculate")->argument;
   const char *profile = arg(options, "profile")->argument;
   const char *init    = arg(options, "init")->argument;
   const char *hash    = arg(options, "debug-target")->argument;
@@ -245,6 +317,62 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (cgroups && strcmp(cgroups, "account") && strcmp(cgroups, "limit")) {
+    std::cerr << "Cannot run with cgroups mode '" << cgroups << "' (must be account or limit)!" << std::endl;
+    return 1;
+  }
+
+  uint64_t read_size = 0;
+  if (readsize && (!parse_size(readsize, read_size) || read_size < 4096 || read_size > (64<<20))) {
+    std::cerr << "Cannot read job output in chunks of '" << readsize << "' (must be >= 4K and <= 64M)!" << std::endl;
+    return 1;
+  }
+
+  uint64_t flush_bytes = 0;
+  if (logflush && (!parse_size(logflush, flush_bytes) || flush_bytes == 0)) {
+    std::cerr << "Cannot flush job output every '" << logflush << "' (must be a positive byte count, eg: 1M)!" << std::endl;
+    return 1;
+  }
+
+  double flush_seconds = -1;
+  if (logdelay) {
+    char *tail;
+    flush_seconds = strtod(logdelay, &tail);
+    if (*tail || !(flush_seconds >= 0)) {
+      std::cerr << "Cannot delay saving job output by '" << logdelay << "' seconds (must be >= 0)!" << std::endl;
+      return 1;
+    }
+  }
+
+  uint64_t spill_limit = 0;
+  if (spill && !parse_size(spill, spill_limit)) {
+    std::cerr << "Cannot spill job output beyond '" << spill << "' (must be a byte count, eg: 64M)!" << std::endl;
+    return 1;
+  }
+
+  if (spilldir && !spill) {
+    std::cerr << "Cannot use --spill-dir without --spill!" << std::endl;
+    return 1;
+  }
+  std::string spill_dir = spilldir ? spilldir : ".build/spill";
+
+  int speculate = 0;
+  if (speculates) {
+    char *tail;
+    speculate = strtol(speculates, &tail, 10);
+    if (*tail || speculate < 1) {
+      std::cerr << "Cannot speculate " << speculates << " jobs (must be >= 1)!" << std::endl;
+      return 1;
+    }
+  }
+
+  ResourceLimits resources;
+  std::string badres;
+  if (rlimits && !parse_resources(rlimits, resources, badres)) {
+    std::cerr << "Cannot run with resource '" << badres << "' (must be NAME=COUNT with COUNT >= 1)!" << std::endl;
+    return 1;
+  }
+
   // Change directory to the location of the invoked script
   // and execute the specified target function
   if (shebang) {
@@ -281,8 +409,21 @@ int main(int argc, char **argv) {
 
   if (nodb) return 0;
 
+  // Resources declared by the workspace come first, so the command-line may override them
+  std::ifstream wakeresources(".wakeresources");
+  if (workspace && wakeresources) {
+    std::stringstream body;
+    body << wakeresources.rdbuf();
+    ResourceLimits declared;
+    if (!parse_resources(body.str(), declared, badres)) {
+      std::cerr << "Invalid resource '" << badres << "' in .wakeresources (must be NAME=COUNT with COUNT >= 1)" << std::endl;
+      return 1;
+    }
+    resources.insert(resources.begin(), declared.begin(), declared.end());
+  }
+
   Database db(debugdb);
-  std::string fail = db.open(wait, !workspace);
+  std::string fail = db.open(wait, !workspace, noparse);
   if (!fail.empty()) {
     std::cerr << "Failed to open wake.db: " << fail << std::endl;
     return 1;
@@ -495,8 +636,14 @@ int main(int argc, char **argv) {
   status_set_bulk_fd(5, fd5);
 
   /* Primitives */
-  JobTable jobtable(&db, percent, debug, verbose, quiet, check, !tty);
-  StringInfo info(verbose, debug, quiet, VERSION_STR, make_canonical(wake_cwd), cmdline);
+  JobTable jobtable(&db, percent, debug, verbose, quiet, check, !tty, adaptive, profile ? &tree : nullptr);
+  for (auto &r : resources) jobtable.add_resource(r.first, r.second);
+  if (cgroups) jobtable.use_cgroups(!strcmp(cgroups, "limit"));
+  if (mempause) jobtable.pause_on_memory();
+  if (jobstats) jobtable.record_stats();
+  jobtable.buffer_output(read_size, flush_bytes, flush_seconds);
+  if (spill) jobtable.spill_output(spill_limit, spill_dir);
+  StringInfo info(verbose, debug, quiet, VERSION_STR, make_canonical(wake_cwd), cmdline, &db);
   PrimMap pmap = prim_register_all(&info, &jobtable);
 
   std::unique_ptr<Expr> root = bind_refs(std::move(top), pmap);
@@ -593,6 +740,7 @@ int main(int argc, char **argv) {
 
   db.prepare();
   runtime.init(static_cast<RFun*>(ssa.get()));
+  if (speculate) jobtable.speculate(runtime, speculate);
 
   // Flush buffered IO before we enter the main loop (which uses unbuffered IO exclusively)
   std::cout << std::flush;
@@ -637,5 +785,7 @@ int main(int argc, char **argv) {
   }
 
   db.clean();
+  db.sweep_spills(spill_dir);
+  jobtable.report_stats();
   return pass?0:1;
 }
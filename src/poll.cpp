@@ -0,0 +1,158 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+// Build with -DUSE_PSELECT to exercise the portable implementation on linux
+#if defined(__linux__) && !defined(USE_PSELECT)
+#define USE_EPOLL 1
+#endif
+
+#include <sys/select.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <fcntl.h>
+#else
+#include <set>
+#endif
+
+#include "poll.h"
+
+#ifdef USE_EPOLL
+
+// Enough to drain a burst of completions without looping
+#define MAX_EVENTS 128
+
+struct Poll::detail {
+  int epfd;
+  struct epoll_event events[MAX_EVENTS];
+};
+
+Poll::Poll() : imp(new Poll::detail) {
+  imp->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (imp->epfd == -1) {
+    perror("epoll_create1");
+    exit(1);
+  }
+}
+
+Poll::~Poll() {
+  close(imp->epfd);
+}
+
+void Poll::add(int fd) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(imp->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    perror("epoll_ctl(EPOLL_CTL_ADD)");
+    exit(1);
+  }
+}
+
+void Poll::remove(int fd) {
+  struct epoll_event ev; // ignored, but must be non-null before linux 2.6.9
+  if (epoll_ctl(imp->epfd, EPOLL_CTL_DEL, fd, &ev) == -1) {
+    perror("epoll_ctl(EPOLL_CTL_DEL)");
+    exit(1);
+  }
+}
+
+std::vector<int> Poll::wait(struct timespec *timeout, sigset_t *saved) {
+  std::vector<int> out;
+
+  // epoll has only millisecond resolution; round up so we never spin
+  int ms = -1;
+  if (timeout) {
+    long long round = timeout->tv_sec * 1000LL + (timeout->tv_nsec + 999999) / 1000000;
+    ms = round > INT_MAX ? INT_MAX : round;
+  }
+
+  int ret = epoll_pwait(imp->epfd, &imp->events[0], MAX_EVENTS, ms, saved);
+  if (ret == -1 && errno != EINTR) {
+    perror("epoll_pwait");
+    exit(1);
+  }
+
+  for (int i = 0; i < ret; ++i)
+    out.push_back(imp->events[i].data.fd);
+
+  return out;
+}
+
+long Poll::max_fds() const {
+  // epoll is only limited by RLIMIT_NOFILE
+  return LONG_MAX;
+}
+
+#else
+
+struct Poll::detail {
+  std::set<int> fds;
+};
+
+Poll::Poll() : imp(new Poll::detail) {
+}
+
+Poll::~Poll() {
+}
+
+void Poll::add(int fd) {
+  imp->fds.insert(fd);
+}
+
+void Poll::remove(int fd) {
+  imp->fds.erase(fd);
+}
+
+std::vector<int> Poll::wait(struct timespec *timeout, sigset_t *saved) {
+  std::vector<int> out;
+  fd_set set;
+  int nfds = 0;
+
+  FD_ZERO(&set);
+  for (int fd : imp->fds) {
+    if (fd >= nfds) nfds = fd + 1;
+    FD_SET(fd, &set);
+  }
+
+  int ret = pselect(nfds, &set, 0, 0, timeout, saved);
+  if (ret == -1 && errno != EINTR) {
+    perror("pselect");
+    exit(1);
+  }
+
+  if (ret > 0) for (int fd : imp->fds)
+    if (FD_ISSET(fd, &set))
+      out.push_back(fd);
+
+  return out;
+}
+
+long Poll::max_fds() const {
+  return FD_SETSIZE;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POLL_H
+#define POLL_H
+
+#include <signal.h>
+#include <time.h>
+
+#include <memory>
+#include <vector>
+
+// Wait for any of a set of file descriptors to become readable.
+// On linux this uses epoll, so the cost of a wait is proportional to the
+// number of ready descriptors. Elsewhere it falls back to pselect().
+struct Poll {
+  struct detail;
+  std::unique_ptr<detail> imp;
+
+  Poll();
+  ~Poll();
+
+  void add(int fd);
+  void remove(int fd);
+
+  // Block until a descriptor is readable, the timeout expires, or a signal arrives.
+  // While waiting, the signal mask is atomically replaced by 'saved' (as in pselect).
+  // A null timeout waits forever. Returns the readable descriptors (empty on EINTR).
+  std::vector<int> wait(struct timespec *timeout, sigset_t *saved);
+
+  // The largest number of descriptors this Poll can watch at once
+  long max_fds() const;
+};
+
+#endif
@@ -31,6 +31,7 @@ struct RegExp;
 struct Scope;
 struct Record;
 struct Expr;
+struct Database;
 
 /* Macros for handling inputs from wake */
 #define RETURN(val) do {						\
@@ -160,8 +161,9 @@ struct StringInfo {
   std::string version;
   std::string wake_cwd;
   char **cmdline;
-  StringInfo(bool v, bool d, bool q, const std::string &version_, const std::string &wake_cwd_, char **cmdline_)
-   : verbose(v), debug(d), quiet(q), version(version_), wake_cwd(wake_cwd_), cmdline(cmdline_) { }
+  Database *db; // told about files wake writes itself
+  StringInfo(bool v, bool d, bool q, const std::string &version_, const std::string &wake_cwd_, char **cmdline_, Database *db_)
+   : verbose(v), debug(d), quiet(q), version(version_), wake_cwd(wake_cwd_), cmdline(cmdline_), db(db_) { }
 };
 
 void prim_register(PrimMap &pmap, const char *key, PrimFn fn, PrimType type, int flags, void *data = 0);
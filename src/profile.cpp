@@ -57,6 +57,14 @@ void Profile::report(const char *file, const std::string &command) const {
       f << "<style type=\"application/json\" id=\"dataset\">";
       dump_tree(f, command + ": command-line", this);
       f << "</style>" << std::endl;
+      f << "<style type=\"application/json\" id=\"limitset\">[";
+      for (size_t i = 0; i < limits.size(); ++i) {
+        if (i) f << ",";
+        f << "{\"time\":" << limits[i].time
+          << ",\"limit\":" << limits[i].limit
+          << ",\"reason\":\"" << json_escape(limits[i].reason) << "\"}";
+      }
+      f << "]</style>" << std::endl;
       std::ifstream html(find_execpath() + "/../share/wake/html/profile.html");
       f << html.rdbuf();
     }
@@ -20,9 +20,20 @@
 
 #include <string>
 #include <map>
+#include <vector>
+
+// A change made to the job limit by the adaptive scheduler (--adaptive)
+struct LimitChange {
+  double time;  // seconds since the first job was scheduled
+  double limit; // CPUs which may now be used by jobs
+  std::string reason;
+  LimitChange(double time_, double limit_, const std::string &reason_)
+   : time(time_), limit(limit_), reason(reason_) { }
+};
 
 struct Profile {
   std::map<std::string, Profile> children;
+  std::vector<LimitChange> limits; // only recorded in the root
   unsigned count;
 
   Profile() : count(0) { }
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "speculate.h"
+#include "mkdir_parents.h"
+#include "spawn.h"
+#include "unlink.h"
+
+// Hashes are reported as this many hex digits
+#define HASH_DIGITS 64
+
+static std::string parent(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? std::string() : path.substr(0, slash);
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t wrote = write(fd, data, len);
+    if (wrote == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += wrote;
+    len -= wrote;
+  }
+  return true;
+}
+
+// A copy, rather than a link, so that a job which rewrites its input leaves the workspace alone
+static bool copy_file(const std::string &from, const std::string &to, mode_t mode) {
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) return false;
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 07777);
+  if (out == -1) {
+    close(in);
+    return errno == EEXIST;
+  }
+
+  char buffer[16384];
+  ssize_t got;
+  bool ok = true;
+  while (ok && (got = read(in, buffer, sizeof(buffer))) != 0) {
+    if (got == -1) {
+      ok = errno == EINTR;
+    } else {
+      ok = write_all(out, buffer, got);
+    }
+  }
+
+  close(in);
+  return close(out) == 0 && ok;
+}
+
+static bool copy_link(const std::string &from, const std::string &to, const struct stat &st) {
+  std::string target(st.st_size + 1, 0);
+  ssize_t len = readlink(from.c_str(), &target[0], target.size());
+  if (len < 0) return false;
+  target.resize(len);
+  return symlink(target.c_str(), to.c_str()) == 0 || errno == EEXIST;
+}
+
+bool Scratch::create(const std::string &root_, const std::vector<std::string> &inputs, const std::string &directory, std::string &why) {
+  root = root_;
+
+  int err = mkdir_with_parents(root + "/" + directory, 0775);
+  if (err != 0) {
+    why = "mkdir " + root + "/" + directory + ": " + strerror(err);
+    return false;
+  }
+
+  for (auto &input : inputs) {
+    std::string path = root + "/" + input;
+    struct stat st;
+    if (lstat(input.c_str(), &st) != 0) {
+      why = "stat " + input + ": " + strerror(errno);
+      return false;
+    }
+
+    std::string dir = parent(path);
+    if (S_ISDIR(st.st_mode)) dir = path;
+    if ((err = mkdir_with_parents(dir, 0775)) != 0) {
+      why = "mkdir " + dir + ": " + strerror(err);
+      return false;
+    }
+
+    if (S_ISDIR(st.st_mode)) continue;
+    if (!(S_ISLNK(st.st_mode) ? copy_link(input, path, st) : copy_file(input, path, st.st_mode))) {
+      why = "copy " + input + ": " + strerror(errno);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Scratch::has(const std::string &path) const {
+  struct stat st;
+  return lstat((root + "/" + path).c_str(), &st) == 0 && !S_ISDIR(st.st_mode);
+}
+
+bool Scratch::publish(const std::vector<std::string> &outputs, std::string &why) const {
+  for (auto &output : outputs) {
+    std::string dir = parent(output);
+    int err;
+    if (!dir.empty() && (err = mkdir_with_parents(dir, 0775)) != 0) {
+      why = "mkdir " + dir + ": " + strerror(err);
+      return false;
+    }
+    if (rename((root + "/" + output).c_str(), output.c_str()) != 0) {
+      why = "rename " + output + ": " + strerror(errno);
+      return false;
+    }
+  }
+  return true;
+}
+
+void Scratch::remove() {
+  if (!root.empty()) deep_unlink(AT_FDCWD, root.c_str());
+  root.clear();
+}
+
+std::string hash_file(const std::string &shim, const std::string &path) {
+  int pipefd[2];
+  if (pipe(pipefd) == -1) return "";
+  int flags;
+  if ((flags = fcntl(pipefd[0], F_GETFD, 0)) != -1) fcntl(pipefd[0], F_SETFD, flags | FD_CLOEXEC);
+
+  std::string out = std::to_string(pipefd[1]);
+  const char *argv[] = { shim.c_str(), "/dev/null", out.c_str(), "2", ".", "<hash>", path.c_str(), nullptr };
+  const char *envp[] = { nullptr };
+  pid_t pid = wake_spawn(argv[0], const_cast<char**>(argv), const_cast<char**>(envp));
+  close(pipefd[1]);
+
+  std::string hash;
+  char buffer[HASH_DIGITS+1];
+  ssize_t got;
+  while (pid != -1 && ((got = read(pipefd[0], buffer, sizeof(buffer))) > 0 || (got < 0 && errno == EINTR)))
+    if (got > 0) hash.append(buffer, got);
+  close(pipefd[0]);
+
+  int status = 1;
+  while (pid != -1 && waitpid(pid, &status, 0) == -1 && errno == EINTR) { }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || hash.size() < HASH_DIGITS) return "";
+  return hash.substr(0, HASH_DIGITS);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPECULATE_H
+#define SPECULATE_H
+
+#include <string>
+#include <vector>
+
+// A private directory where a job runs before wake knows if it is wanted (see --speculate).
+// It holds copies of only the files the job read last time, so the job cannot change the workspace.
+struct Scratch {
+  std::string root; // eg: .build/speculate/42
+
+  // Copy the inputs below root and create the job's directory; on failure, 'why' explains
+  bool create(const std::string &root, const std::vector<std::string> &inputs, const std::string &directory, std::string &why);
+  // True if a file or symlink exists at this workspace path below root
+  bool has(const std::string &path) const;
+  // Move outputs into the workspace; on failure, 'why' explains
+  bool publish(const std::vector<std::string> &outputs, std::string &why) const;
+  void remove();
+};
+
+// The hash wake records for a file (computed by shim-wake, as for '<hash>' jobs), or "" on failure
+std::string hash_file(const std::string &shim, const std::string &path);
+
+#endif
@@ -21,6 +21,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <termios.h>
@@ -100,9 +101,27 @@ static void write_all(int fd, const char *data, size_t len)
   }
 }
 
-static void write_all_str(int fd, const char *data)
+static void writev_all(int fd, struct iovec *iov, int count)
 {
-  write_all(fd, data, strlen(data));
+  ssize_t got;
+  while (!JobTable::exit_now() && count > 0) {
+    got = writev(fd, iov, count);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (; count > 0 && (size_t)got >= iov->iov_len; ++iov, --count) got -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + got;
+      iov->iov_len -= got;
+    }
+  }
+}
+
+static void set_iov(struct iovec &iov, const char *str)
+{
+  iov.iov_base = const_cast<char*>(str);
+  iov.iov_len = strlen(str);
 }
 
 static void status_clear()
@@ -365,20 +384,38 @@ void status_set_bulk_fd(int fd, const char *streams)
   }
 }
 
+bool status_enabled(const char *name)
+{
+  auto it = settings.find(name);
+  return it != settings.end() && it->second.fd != -1;
+}
+
 void status_write(const char *name, const char *data, int len)
+{
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(data);
+  iov.iov_len = len;
+  status_writev(name, &iov, 1);
+}
+
+void status_writev(const char *name, const struct iovec *data, int count)
 {
   StreamSettings s = settings[name];
   if (s.fd != -1) {
+    // colour, intensity, data, normal
+    struct iovec iov[STATUS_MAX_IOV+3];
+    int n = 0;
+    assert (count <= STATUS_MAX_IOV);
     status_clear();
     if (s.colour != TERM_DEFAULT) {
       int colour = s.colour % 8;
       int intensity = s.colour / 16;
-      if (colour != TERM_DEFAULT) write_all_str(s.fd, term_colour(colour));
-      if (intensity != TERM_DEFAULT) write_all_str(s.fd, term_intensity(intensity));
+      if (colour != TERM_DEFAULT) set_iov(iov[n++], term_colour(colour));
+      if (intensity != TERM_DEFAULT) set_iov(iov[n++], term_intensity(intensity));
     }
-    write_all(s.fd, data, len);
-    if (s.colour != TERM_DEFAULT)
-      write_all_str(s.fd, term_normal());
+    for (int i = 0; i < count; ++i) iov[n++] = data[i];
+    if (s.colour != TERM_DEFAULT) set_iov(iov[n++], term_normal());
+    writev_all(s.fd, iov, n);
     refresh_needed = true;
   }
 }
@@ -21,6 +21,7 @@
 #include <list>
 #include <string>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 struct Status {
   std::string cmdline;
@@ -51,9 +52,14 @@ extern StatusState status_state;
 #define STREAM_ECHO	"echo"
 #define STREAM_WARNING	"warning"
 #define STREAM_ERROR	"error"
+// One JSON object per line describing scheduler events; never shown unless routed (eg: --fd:3 telemetry)
+#define STREAM_TELEMETRY	"telemetry"
 
 void status_init();
 void status_write(const char *name, const char *data, int len);
+// Write several pieces at once (at most STATUS_MAX_IOV), avoiding a copy to join them
+#define STATUS_MAX_IOV 4
+void status_writev(const char *name, const struct iovec *data, int count);
 inline void status_write(const char *name, const std::string &str) { status_write(name, str.data(), str.size()); }
 void status_refresh(bool idle);
 void status_finish();
@@ -61,6 +67,7 @@ void status_finish();
 void status_set_colour(const char *name, int colour);
 void status_set_fd(const char *name, int fd);
 void status_set_bulk_fd(int fd, const char *streams);
+bool status_enabled(const char *name); // is the stream written anywhere?
 
 void term_init(bool tty);
 
@@ -39,6 +39,7 @@
 #include "gc.h"
 #include "shell.h"
 #include "unlink.h"
+#include "database.h"
 
 static PRIMTYPE(type_vcat) {
   bool ok = out->unify(String::typeVar);
@@ -232,6 +233,7 @@ static PRIMTYPE(type_write) {
 }
 
 static PRIMFN(prim_write) {
+  StringInfo *info = static_cast<StringInfo*>(data);
   EXPECT(3);
   INTEGER_MPZ(mode, 0);
   STRING(path, 1);
@@ -246,6 +248,7 @@ static PRIMFN(prim_write) {
   REQUIRE(mpz_cmp_si(mode, 0x1ff) <= 0);
   long mask = mpz_get_si(mode);
 
+  info->db->forget_path(path->as_str());
   deep_unlink(AT_FDCWD, path->c_str());
   std::ofstream t(path->c_str(), std::ios_base::trunc);
   if (!t.fail()) {
@@ -273,6 +276,7 @@ static PRIMTYPE(type_unlink) {
 }
 
 static PRIMFN(prim_unlink) {
+  StringInfo *info = static_cast<StringInfo*>(data);
   EXPECT(1);
   STRING(path, 0);
 
@@ -280,6 +284,7 @@ static PRIMFN(prim_unlink) {
   runtime.heap.reserve(reserve_unit());
 
   // don't care if this succeeds
+  info->db->forget_path(path->as_str());
   (void)unlink(path->c_str());
 
   RETURN(claim_unit(runtime.heap));
@@ -688,7 +693,7 @@ void prim_register_string(PrimMap &pmap, StringInfo *info) {
   prim_register(pmap, "colour",   prim_colour,   type_colour,    PRIM_IMPURE);
   prim_register(pmap, "print",    prim_print,    type_print,     PRIM_IMPURE);
   prim_register(pmap, "mkdir",    prim_mkdir,    type_mkdir,     PRIM_IMPURE);
-  prim_register(pmap, "unlink",   prim_unlink,   type_unlink,    PRIM_IMPURE);
-  prim_register(pmap, "write",    prim_write,    type_write,     PRIM_IMPURE);
+  prim_register(pmap, "unlink",   prim_unlink,   type_unlink,    PRIM_IMPURE, (void*)info);
+  prim_register(pmap, "write",    prim_write,    type_write,     PRIM_IMPURE, (void*)info);
   prim_register(pmap, "read",     prim_read,     type_read,      PRIM_ORDERED);
 }
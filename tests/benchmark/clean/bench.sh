@@ -0,0 +1,23 @@
+#! /bin/sh
+
+# Database clean-up benchmark.
+# Usage: bench.sh [wake] [jobs]
+# Builds DAGs of increasing size, then rebuilds each from the cache and reports the time
+# spent cleaning up the database, which includes computing every job's critical path.
+
+set -e
+
+WAKE="${1:-wake}"
+JOBS="${2:-8000}"
+
+cd "$(dirname "$0")"
+
+for n in "$((JOBS / 4))" "$((JOBS / 2))" "$JOBS"; do
+  rm -rf wake.db out
+  "$WAKE" --init .
+  "$WAKE" --no-tty dag "$n" 100 >/dev/null
+  echo "=== dag $n 100 (cached)"
+  "$WAKE" --no-tty --job-stats dag "$n" 100 | grep -E "^Pass|Database time"
+done
+
+rm -rf wake.db out
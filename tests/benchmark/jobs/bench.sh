@@ -0,0 +1,27 @@
+#! /bin/sh
+
+# Job launch throughput benchmark.
+# Usage: bench.sh [wake] [jobs]
+# Each workload reports jobs/s, launch latency, scheduler and database time (--job-stats).
+
+set -e
+
+WAKE="${1:-wake}"
+JOBS="${2:-10000}"
+
+cd "$(dirname "$0")"
+rm -f wake.db
+"$WAKE" --init .
+
+run() {
+  echo "=== $*"
+  "$WAKE" --no-tty --job-stats "$@"
+}
+
+run wide "$JOBS" 0
+run wide "$JOBS" 4096
+run wide "$JOBS" 65536
+run layers 100 "$((JOBS / 100))" 0
+run chain "$((JOBS / 10))"
+
+rm -f wake.db
@@ -0,0 +1,26 @@
+#! /bin/sh
+
+# Job output line framing benchmark.
+# Usage: bench.sh [wake] [jobs] [bytes]
+# Each workload reports scheduler time (--job-stats), which includes splitting output into lines.
+
+set -e
+
+WAKE="${1:-wake}"
+JOBS="${2:-100}"
+BYTES="${3:-4194304}"
+
+cd "$(dirname "$0")"
+rm -f wake.db
+"$WAKE" --init .
+
+run() {
+  echo "=== $*"
+  "$WAKE" --job-stats --fd:3=bench "$@" 3>/dev/null
+}
+
+run lines "$JOBS" "$BYTES" 80
+run lines "$JOBS" "$BYTES" 60000
+run lines "$JOBS" "$BYTES" 0
+
+rm -f wake.db
@@ -0,0 +1,13 @@
+#! /bin/sh
+
+set -e
+
+WAKE="${1:-wake}"
+WORKER="$(dirname "$(command -v "$WAKE")")/remote-waked"
+
+rm -rf .worker .build upper.txt sub wake.db
+"$WORKER" -j 2 unix:.worker/socket .worker &
+trap 'kill $!; rm -rf .worker .build input.txt upper.txt sub wake.db' EXIT
+while ! test -S .worker/socket; do sleep 0.1; done
+
+"$WAKE" test